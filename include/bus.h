@@ -34,6 +34,10 @@ public:
     // Returns size written
     size_t write_file(const u64 address, const std::string& filename);
 
+    // For the JIT; returns where a physical page lives in host memory if
+    // it's entirely RAM (so can be accessed directly), or nullptr if not
+    u8* get_host_page(const u64 page_address);
+
     // Bus layout for emulator
     constexpr static u64 plic_base = 0xc000000;
     constexpr static u64 plic_end = plic_base + 0x3fff004;
@@ -46,10 +50,46 @@ public:
     constexpr static u64 ram_base = 0x80000000;
     constexpr static u64 programs_base = 0x80000000;
 
-    // For A extension
-    std::unordered_set<u64> reservations = {};
+    // For A extension; the address reserved by the last LR, if any. With the
+    // one hart there's only ever the one reservation, and as LR/SC have to be
+    // aligned no real address can match no_reservation
+    constexpr static u64 no_reservation = ~0ULL;
+    u64 reservation = no_reservation;
+
+    /*
+        For the JIT; which pages of RAM have had code translated from them, so
+        that any write to them (self-modifying code, loading modules, DMA,
+        etc.) can be noticed. A written page stops being a code page until
+        it's translated from again, and is remembered (by physical page
+        number) until the JIT gets round to throwing away its frames, or if
+        there's no JIT, the interpreter its predecoded blocks. Stores to code
+        pages must all come through here, so they're kept out of the fast TLB
+        (see CPU::fill_fast_tlb).
+    */
+    void mark_code_page(const u64 address);
+    inline bool is_code_page(const u64 address) const
+    {
+        const u64 page = (address - ram_base) / code_page_size;
+        return address >= ram_base && page < code_pages.size() && code_pages[page];
+    }
+    inline void check_for_code_write(const u64 address, const u64 size)
+    {
+        if (is_code_page(address)) [[unlikely]]
+            note_code_write(address);
+        if (is_code_page(address + size - 1)) [[unlikely]]
+            note_code_write(address + size - 1);
+    }
+    std::vector<u64> written_code_pages;
+    bool is_jit_enabled = false;
 
-    void clock(CPU& cpu, bool is_jit = false);
+    // Goes up on every write to a code page, for the interpreter's
+    // predecoded blocks
+    u64 code_writes = 0;
+
+    // The JIT clocks once per frame, and the interpreter once per block, for
+    // as many cycles as they ran
+    void clock(CPU& cpu, bool is_jit = false, u64 cycles = 1);
+    u64 get_cycles_until_timer() const { return clint.get_ticks_until_interrupt(); }
 
 private:
     std::pair<BusDevice&, u64> get_bus_device(const u64 address, const u64 size);
@@ -61,4 +101,8 @@ private:
     VirtioBlockDevice block_device;
     u64 clock_counter = 0;
     bool is_test_mode;
+
+    void note_code_write(const u64 address);
+    constexpr static u64 code_page_size = 4096;
+    std::vector<bool> code_pages;
 };
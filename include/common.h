@@ -13,9 +13,13 @@
 #include <expected>
 #include <optional>
 #include <array>
+#include <bitset>
 #include <queue>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <functional>
 
 // For UART stdin
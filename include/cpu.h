@@ -7,6 +7,7 @@
 #include "instruction.h"
 #include "compressed_instruction.h"
 #include "opcodes_f.h"
+#include "decoder.h"
 
 class CPU
 {
@@ -20,6 +21,11 @@ public:
     void do_cycle();
     void trace();
 
+    // Runs the rest of the current predecoded block (or up to the timer) in
+    // one go, for the main loop to catch devices and counters up on after;
+    // returns how many instructions ran
+    u64 run_block();
+
     /*
         32 integer registers:
         - x0 (zero):        always zero
@@ -232,27 +238,211 @@ public:
     bool emulating_test = false;
 
     void invalidate_tlb();
-    void check_for_invalid_tlb();
+
+    // For sfence.vma; a page and/or an address space (leaving out either
+    // meaning all of them), though global mappings go only by page
+    void invalidate_tlb(const std::optional<u64> address, const std::optional<u64> asid);
+
+    // satp has switched to another ASID; only what isn't tagged with it has
+    // to go
+    void switch_address_space();
+
+    // Call after anything that might've changed the privilege level or mstatus,
+    // which decide what cached translations may be used for
+    void update_tlb_permissions();
+
+    // Drops every predecoded block, for when translations have really changed
+    // (i.e. not just for a change of privilege level, which blocks are
+    // tagged with anyway)
+    void invalidate_decoded_blocks() { ++decoded_generation; }
+
+    // Drops the predecoded blocks on pages in Bus::written_code_pages
+    void invalidate_written_blocks();
 
     // For JIT
     bool tlb_was_flushed = false;
+    bool instruction_cache_was_flushed = false;
+
+    /*
+        Also for the JIT; native code counts the instructions it runs into
+        jit_instructions (so the main loop can catch devices and counters up
+        by as many) and takes them off jit_budget, which it checks at every
+        loop backedge and chained exit, leaving once it's run out. Anything
+        that needs the main loop's attention sooner can just zero it.
+    */
+    i64 jit_budget = 0;
+    u64 jit_instructions = 0;
+
+    // Translates an instruction fetch without performing it, so that cached
+    // code can be found by physical address
+    std::expected<u64, Exception> translate_instruction_address(const u64 address);
+
+    /*
+        Also for the JIT; direct-mapped caches of virtual pages that loads and
+        stores have already succeeded on and that are plain RAM, so that JIT'd
+        code can add host_addend to the address and access memory itself. An
+        entry is only made once the slow path has dealt with the A and D bits,
+        and they're all thrown away along with the TLB.
+    */
+    struct FastTLBEntry
+    {
+        static constexpr u64 invalid_page = std::numeric_limits<u64>::max();
+        u64 virtual_page = invalid_page;
+        u64 host_addend = 0;
+    };
+    static constexpr size_t fast_tlb_size = 256;
+    std::array<FastTLBEntry, fast_tlb_size> fast_load_tlb = {};
+    std::array<FastTLBEntry, fast_tlb_size> fast_store_tlb = {};
+
+    void fill_fast_tlb(const u64 address, const AccessType type);
+
+    // Has the bus watch for writes to a page that code's being translated
+    // from (see Bus::mark_code_page), taking it out of the fast TLB
+    void protect_code_page(const u64 physical_address);
 
 private:
-    void execute_instruction(const Instruction instruction);
-    void execute_compressed_instruction(const CompressedInstruction instruction);
+    /*
+        The interpreter doesn't fetch and decode every instruction every time
+        it's run; runs of instructions up to the next control transfer (or
+        the end of the page) are decoded once into a block, kept in a
+        direct-mapped cache by virtual PC, privilege level and ASID (unless it
+        was fetched from a global mapping), and stepped through from then on.
+        Blocks from before the last TLB flush are just treated as missing, by
+        way of decoded_generation, while those on a code page that's since
+        been written (see Bus::mark_code_page) are found by the physical pages
+        they were fetched from and dropped.
+    */
+    struct DecodedInstruction
+    {
+        DecodedHandler handler;
+        u32 instruction;
+        u8 length;
+    };
+    struct DecodedBlock
+    {
+        static constexpr u64 invalid_pc = std::numeric_limits<u64>::max();
+        u64 pc = invalid_pc;
+        u64 generation = 0;
+        PrivilegeLevel privilege_level = PrivilegeLevel::Machine;
+        u64 asid = 0;
+        bool is_global = true;
+
+        // The page it starts on, and the one it ends on if it straddles two
+        std::array<u64, 2> physical_pages = { invalid_pc, invalid_pc };
+        std::vector<DecodedInstruction> instructions;
+    };
+    static constexpr size_t decoded_blocks_size = 4096;
+    static constexpr size_t decoded_block_limit = 64;
+    std::array<DecodedBlock, decoded_blocks_size> decoded_blocks = {};
+    u64 decoded_generation = 1;
+    u64 decoded_code_writes = 0;
+
+    // Where do_cycle is up to, so it can go straight on to the next one
+    DecodedBlock* current_block = nullptr;
+    size_t next_decoded_index = 0;
+    u64 next_decoded_pc = DecodedBlock::invalid_pc;
+
+    const DecodedInstruction* get_decoded_instruction();
+    DecodedBlock* decode_block();
     u64 get_exception_cause(const Exception exception);
 
+    /*
+        Translations are cached in separate direct-mapped instruction and data
+        TLBs. Each entry keeps the low byte of its PTE, and whether that allows
+        an access under the current privilege level and mstatus is looked up
+        in tlb_permissions, which is rebuilt whenever those change rather than
+        throwing the translations away. As the A bit (and for stores, D bit)
+        has to be set for an access to be allowed, a hit never has to go back
+        to the page table. Pages of plain RAM also get the host address of the
+        page less the virtual one, so that reads and writes can go straight to
+        memory. Stores to code pages have to be seen by the bus, so entries for
+        those never have the D bit (see protect_code_page).
+
+        Megapages and gigapages take a single entry, tagged with the number of
+        the whole region rather than of a 4 KiB page, and found in the slot
+        that number maps to. A lookup tries each size in turn, smallest first.
+        As one of those might cover a code page as well as plain RAM, stores
+        through them check for code pages as they go.
+    */
     struct TLBEntry
     {
-        u64 virtual_page;
-        u64 physical_page;
-        u64 pte_address;
-        u64 pte;
-        AccessType access_type;
-        bool valid = false;
+        static constexpr u64 invalid_page = std::numeric_limits<u64>::max();
+        u64 virtual_page = invalid_page;
+        u64 physical_page = 0;
+        u64 host_addend = 0;
+        u64 asid = 0;
+        u8 pte_flags = 0;
+        u8 level = 0;
+        bool is_ram = false;
+        bool is_global = false;
     };
-    std::array<TLBEntry, 4> tlb = {};
-    size_t tlb_entries = 0;
+    static constexpr size_t tlb_size = 1024;
+    static constexpr u64 tlb_levels = 3;
+    std::array<TLBEntry, tlb_size> instruction_tlb = {};
+    std::array<TLBEntry, tlb_size> data_tlb = {};
+
+    // Indexed by PTE flags, giving one bit per AccessType that's allowed
+    std::array<u8, 256> tlb_permissions = {};
+
+    static constexpr u8 get_tlb_permission(const AccessType type) { return 1 << (u8)type; }
+
+    // Each level up covers 512 times as many 4 KiB pages
+    static constexpr u64 get_tlb_page_shift(const u64 level) { return 9 * level; }
+
+    void build_tlb_permissions();
+
+    inline bool is_tlb_allowed(const TLBEntry& entry, const AccessType type) const
+    {
+        return (tlb_permissions[entry.pte_flags] & get_tlb_permission(type)) != 0;
+    }
+
+    inline TLBEntry& get_tlb_entry(const u64 virtual_page, const u64 level, const AccessType type)
+    {
+        auto& tlb = (type == AccessType::Instruction) ? instruction_tlb : data_tlb;
+        return tlb[(virtual_page >> get_tlb_page_shift(level)) % tlb_size];
+    }
+
+    // Entries are tagged with the ASID they were made under, unless global
+    inline bool is_tlb_hit(const TLBEntry& entry, const u64 virtual_page, const u64 level) const
+    {
+        return entry.level == level &&
+            entry.virtual_page == (virtual_page >> get_tlb_page_shift(level)) &&
+            (entry.is_global || entry.asid == satp.get_asid());
+    }
+
+    // Whichever entry covers the page, whatever size it is
+    inline TLBEntry* find_tlb_entry(const u64 virtual_page, const AccessType type)
+    {
+        for (u64 level = 0; level < tlb_levels; ++level)
+        {
+            TLBEntry& entry = get_tlb_entry(virtual_page, level, type);
+            if (is_tlb_hit(entry, virtual_page, level))
+                return &entry;
+        }
+        return nullptr;
+    }
+
+    // Where in the entry's (physical) page an address falls
+    static inline u64 get_tlb_offset(const TLBEntry& entry, const u64 address)
+    {
+        const u64 page_size = 4096;
+        return address & ((page_size << get_tlb_page_shift(entry.level)) - 1);
+    }
+
+    // Finds the host address of an aligned access that's already in the TLB
+    inline u8* get_host_address(const u64 address, const AccessType type)
+    {
+        const u64 page_size = 4096;
+        const TLBEntry* entry = find_tlb_entry(address / page_size, type);
+        if (entry == nullptr || !is_tlb_allowed(*entry, type) || !entry->is_ram)
+            return nullptr;
+
+        if (type == AccessType::Store && entry->level != 0 &&
+            bus.is_code_page(entry->physical_page * page_size + get_tlb_offset(*entry, address)))
+            return nullptr;
+
+        return reinterpret_cast<u8*>(address + entry->host_addend);
+    }
 
     std::expected<u64, Exception> tlb_lookup(
         const u64 address,
@@ -263,8 +453,8 @@ private:
         const u64 virtual_page,
         const u64 physical_page,
         const PageTableEntry pte,
-        const u64 pte_address,
-        const AccessType access_type
+        const u64 level,
+        const AccessType type
     );
 
     std::expected<u64, Exception> virtual_address_to_physical(
@@ -272,6 +462,30 @@ private:
         const AccessType type
     );
 
+    /*
+        Most walks go through the same root and mid-level page tables, so the
+        non-leaf PTEs read from them are cached, one direct-mapped cache per
+        level, keyed by the page table they came from and the VPN used to
+        index it. Like the TLB, it's only guaranteed to be right up until the
+        next sfence.vma, so is cleared along with it.
+    */
+    struct PageWalkEntry
+    {
+        static constexpr u64 invalid_page = std::numeric_limits<u64>::max();
+        u64 table_page = invalid_page;
+        u64 vpn = 0;
+        u64 pte = 0;
+    };
+    static constexpr size_t page_walk_cache_size = 256;
+    std::array<std::array<PageWalkEntry, page_walk_cache_size>, 2> page_walk_cache = {};
+
+    PageTableEntry read_page_table_entry(
+        const u64 table_page,
+        const u64 vpn,
+        const i64 level,
+        const AccessType type
+    );
+
     inline PrivilegeLevel effective_privilege_level(const AccessType type) const
     {
         // When MPRV=1, load and store memory addresses are translated and
@@ -301,7 +515,7 @@ private:
     // For mcause
     u64 erroneous_virtual_address;
 
-    // For TLB
+    // What tlb_permissions was last built for
     PrivilegeLevel last_privilege_level = PrivilegeLevel::Machine;
     MStatus last_mstatus = {};
 
@@ -345,6 +559,13 @@ private:
             // Aligned access
             if ((address % sizeof(T)) == 0) [[likely]]
             {
+                if (const u8* host_address = get_host_address(address, type)) [[likely]]
+                {
+                    T value;
+                    std::memcpy(&value, host_address, sizeof(T));
+                    return value;
+                }
+
                 std::expected<u64, Exception> physical_address = tlb_lookup(address, type);
                 if (physical_address.has_value()) [[likely]]
                 {
@@ -404,6 +625,12 @@ private:
             // Aligned access
             if ((address % sizeof(T)) == 0) [[likely]]
             {
+                if (u8* host_address = get_host_address(address, type)) [[likely]]
+                {
+                    std::memcpy(host_address, &value, sizeof(T));
+                    return std::nullopt;
+                }
+
                 const std::expected<u64, Exception> virtual_address = tlb_lookup(address, type);
                 if (virtual_address.has_value()) [[likely]]
                 {
@@ -138,11 +138,11 @@ struct CSR
         }
     }
 
-    bool increment(CPU& cpu)
+    bool increment(CPU& cpu, const u64 count = 1)
     {
         std::optional<u64> value = read(cpu);
         if (!value) return false;
-        return write(*value + 1, cpu);
+        return write(*value + count, cpu);
     }
 
     virtual bool write(const u64 value, CPU& cpu) = 0;
@@ -365,32 +365,7 @@ struct MStatus : CSR
         fields.uxl = 2;
     }
 
-    bool write(const u64 value, CPU&) override
-    {
-        // Don't set the wpri fields; keep them zero (XS is read-only)
-        fields.mbe = (value >> 37) & 0x1;
-        fields.sbe = (value >> 36) & 0x1;
-        fields.tsr = (value >> 22) & 0x1;
-        fields.tw = (value >> 21) & 0x1;
-        fields.tvm = (value >> 20) & 0x1;
-        fields.mxr = (value >> 19) & 0x1;
-        fields.sum = (value >> 18) & 0x1;
-        fields.mprv = (value >> 17) & 0x1;
-        fields.fs = (value >> 13) & 0x3;
-        fields.mpp = (value >> 11) & 0x3;
-        fields.vs = (value >> 9) & 0x3;
-        fields.spp = (value >> 8) & 0x1;
-        fields.mpie = (value >> 7) & 0x1;
-        fields.ube = (value >> 6) & 0x1;
-        fields.spie = (value >> 5) & 0x1;
-        fields.mie = (value >> 3) & 0x1;
-        fields.sie = (value >> 1) & 0x1;
-
-        // SD
-        fields.sd = (fields.fs == 0b11) || (fields.xs == 0b11);
-
-        return true;
-    }
+    bool write(const u64 value, CPU& cpu) override;
 
     std::optional<u64> read(CPU&) override
     {
@@ -586,7 +561,8 @@ struct SATP : CSR
         return ModeSettings((bits >> 60) & 0b1111);
     }
 
-    // ASID = address space identifier
+    // ASID = address space identifier; all 16 bits are writable, which is
+    // how software finds out how many are supported
     u64 get_asid() const
     {
         return (bits >> 44) & 0b1111111111111111;
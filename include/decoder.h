@@ -0,0 +1,15 @@
+#pragma once
+#include "common.h"
+
+class CPU;
+
+/*
+    Instructions are decoded by looking them up in tables built from the
+    opcode, funct3 and funct7 fields (or, for compressed instructions, the
+    whole 16 bits), giving a handler that executes them and moves the PC on.
+    Unknown instructions get a handler that throws.
+*/
+typedef void (*DecodedHandler)(CPU& cpu, const u32 instruction);
+
+DecodedHandler decode_instruction(const u32 instruction);
+DecodedHandler decode_compressed_instruction(const u16 instruction);
@@ -8,7 +8,10 @@ class CLINT : public BusDevice
 public:
     std::optional<u64> read_byte(const u64 address) override;
     bool write_byte(const u64 address, const u8 value) override;
-    void increment(CPU& cpu);
+    void increment(CPU& cpu, u64 ticks = 1);
+
+    // Or 0 if the timer interrupt's already pending
+    u64 get_ticks_until_interrupt() const;
 
 private:
     u32 msip = 0;
@@ -29,6 +29,9 @@ public:
     bool write_32(const u64 address, const u32 value) override;
     bool write_64(const u64 address, const u64 value) override;
 
+    // For the JIT to access memory directly
+    inline u8* get_host_address(const u64 address) { return memory + address; }
+
     uint64_t size;
 private:
     u8* memory;
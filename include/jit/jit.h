@@ -1,6 +1,7 @@
 #pragma once
 #include "common.h"
 #include "jit/llvm.h"
+#include "jit/jit_cache.h"
 #include "instruction.h"
 #include "compressed_instruction.h"
 #include "cpu.h"
@@ -25,6 +26,41 @@ namespace JIT
         Instruction current_instruction;
         CompressedInstruction current_compressed_instruction;
 
+        // For loads and stores (see CPU::FastTLBEntry)
+        llvm::Value* fast_load_tlb;
+        llvm::Value* fast_store_tlb;
+        llvm::Value* load_succeeded = nullptr;
+
+        // For floating point, which is done in place (see jit_f.cpp)
+        llvm::Value* float_registers;
+        llvm::Value* fcsr;
+        llvm::Value* mstatus;
+
+        // For LR/SC (see Bus::reservation)
+        llvm::Value* reservation;
+
+        // CSRs that are just a value, so can be accessed in place (see
+        // jit_zicsr.cpp), by address, and what they're checked against
+        std::unordered_map<u16, llvm::Value*> csrs;
+        llvm::Value* privilege_level;
+
+        // For interrupt polling (see CPU::jit_budget); instructions_run is
+        // kept on the stack until it's flushed to jit_instructions
+        llvm::Value* jit_budget;
+        llvm::Value* jit_instructions;
+        llvm::Value* instructions_run;
+
+        // For register promotion; registers is then a copy of the guest's
+        // kept on the stack (see JIT::sync_promoted_registers)
+        llvm::Value* guest_registers = nullptr;
+        std::bitset<32> read_registers;
+        std::bitset<32> written_registers;
+
+        // For tiering; how often the frame's run, and the Frame it reports
+        // itself as once hot (set when it's linked, see compile_frame)
+        llvm::Value* executions = nullptr;
+        llvm::Value* frame = nullptr;
+
         // Base interface functions
         llvm::Function* on_ecall;
         llvm::Function* on_ebreak;
@@ -34,6 +70,7 @@ namespace JIT
         llvm::Function* on_mret;
         llvm::Function* on_wfi;
         llvm::Function* on_sfence_vma;
+        llvm::Function* on_fence_i;
         llvm::Function* on_lb;
         llvm::Function* on_lh;
         llvm::Function* on_lw;
@@ -43,6 +80,7 @@ namespace JIT
         llvm::Function* on_sw;
         llvm::Function* on_sd;
         llvm::Function* set_fcsr_dz;
+        llvm::Function* on_hot_frame;
 
         // Fallbacks for "tricky" extensions that infrequently pop-up;
         // negligable for performance in most cases
@@ -52,6 +90,14 @@ namespace JIT
         llvm::Function* on_floating_compressed;
 
         bool abort_translation = false;
+
+        // Exits whose target PC is known at compile time
+        struct StaticExit
+        {
+            llvm::BasicBlock* block;
+            u64 target;
+        };
+        std::vector<StaticExit> static_exits;
     };
 
     template <typename T>
@@ -64,46 +110,327 @@ namespace JIT
         Optional(T value) : has_value(true), value(value) {}
     };
 
+    // Everything needed to translate an instruction again later on
+    struct FrameInstruction
+    {
+        u64 pc;
+        u32 instruction;
+        bool is_compressed;
+    };
+
+    /*
+        Frames never cross a page boundary, so a frame's code lives entirely
+        within the physical page of physical_pc. The virtual PC is baked into
+        the generated code too (auipc, jal, etc.), so a frame can only be
+        reused when both addresses match, but it survives any change to the
+        page tables that leaves that mapping alone.
+    */
     struct Frame
     {
-        llvm::ExecutionEngine* engine;
+        typedef u64(*Function)(u64);
+
+        /*
+            Frames start out compiled as quickly as possible and count how
+            often they run. Once that passes the threshold, the instructions
+            they were built from are handed to a background thread to be
+            compiled again with optimisations, and the new code is swapped in
+            between frames on the main thread.
+        */
+        enum class Tier
+        {
+            Baseline,
+            Optimised
+        };
+
+        llvm::orc::ResourceTrackerSP tracker;
+        Function function;
         u64 starting_pc;
         u64 ending_pc;
+        u64 physical_pc;
+        Tier tier = Tier::Baseline;
+
+        // For the code budget; the size of the object the code was linked
+        // from, and when the frame was last run (see evict_cold_frames)
+        u64 code_size = 0;
+        u64 last_used = 0;
+
+        /*
+            Static exits into the same page can be chained directly to the
+            frame they lead to, by tail calling whatever's in the exit's slot.
+            Slots start out empty and are filled in lazily the first time the
+            exit is taken; we must remember who points to who so they can be
+            unlinked again if either frame is thrown away.
+        */
+        u64* chain_slots;
+        size_t chain_slot_count;
+        std::vector<std::pair<Frame*, u64*>> incoming_chains;
+        std::vector<std::pair<Frame*, u64*>> outgoing_chains;
+
+        // For tracing; how often each static exit's been taken and where
+        // it goes, while the frame's still being counted (see form_trace)
+        u64* exit_counts = nullptr;
+        std::vector<u64> exit_targets;
 
-        Frame(llvm::ExecutionEngine* engine, u64 starting_pc, u64 ending_pc) :
-            engine(engine), starting_pc(starting_pc), ending_pc(ending_pc) {}
+        // For tiering and background compilation; a frame thrown away while
+        // being compiled can't be deleted until its compiler is done with it
+        std::vector<FrameInstruction> instructions;
+        bool is_being_compiled = false;
+        bool is_invalidated = false;
+
+        Frame(u64 starting_pc, u64 physical_pc) :
+            tracker(nullptr), function(nullptr), starting_pc(starting_pc), ending_pc(starting_pc),
+            physical_pc(physical_pc), chain_slots(nullptr), chain_slot_count(0) {}
+
+        inline u64 get_physical_page() const { return physical_pc / page_size; }
+        inline u64 get_metadata_size() const
+        {
+            return sizeof(Frame) +
+                instructions.capacity() * sizeof(FrameInstruction) +
+                exit_targets.capacity() * sizeof(u64) +
+                (incoming_chains.capacity() + outgoing_chains.capacity()) * sizeof(std::pair<Frame*, u64*>);
+        }
+        static constexpr u64 page_size = 4096;
+    };
+
+    // The result of compiling a list of instructions, at whichever tier
+    struct FrameCode
+    {
+        llvm::orc::ResourceTrackerSP tracker;
+        Frame::Function function;
+        u64* chain_slots;
+        size_t chain_slot_count;
+        u64* exit_counts = nullptr;
+        std::vector<u64> exit_targets = {};
+        u64 code_size = 0;
     };
 
-    void init();
-    void run_next_frame(
+    /*
+        Finding a frame means translating the PC and searching through every
+        frame in its physical page, so the most recent lookups are remembered
+        by virtual PC (and ASID and privilege level, which decide how the PC
+        is translated) in a direct-mapped cache. An entry stays valid for as
+        long as the mapping it was made under, so the cache must be cleared
+        whenever the TLB is.
+    */
+    struct JumpCacheEntry
+    {
+        u64 pc;
+        u64 asid;
+        PrivilegeLevel privilege_level;
+        Frame* frame;
+    };
+    constexpr size_t jump_cache_size = 4096;
+
+    /*
+        Each tier has a thread of its own so that the guest never has to wait
+        on LLVM, and a slow optimised compile can't hold up a baseline one.
+        Finished code is only picked up by the main thread between frames, as
+        that's the one time nothing can be running what it replaces.
+    */
+    struct CompileQueue
+    {
+        struct Job
+        {
+            CPU* cpu;
+            Frame* frame;
+            std::vector<FrameInstruction> instructions;
+        };
+
+        // The instructions that actually made it into the frame
+        struct Result
+        {
+            Frame* frame;
+            FrameCode code;
+            std::vector<FrameInstruction> instructions;
+        };
+
+        struct Statistics
+        {
+            u64 frames = 0;
+            u64 instructions = 0;
+            std::chrono::nanoseconds time = {};
+        };
+
+        // Each thread has its own LLVM context as they can't be shared
+        llvm::orc::LLJIT* session = nullptr;
+        llvm::orc::ThreadSafeContext context;
+        Frame::Tier tier = Frame::Tier::Baseline;
+        bool count_executions = false;
+        bool promote_registers = false;
+
+        // Frames are named after their hash when cached, with a count to
+        // tell identical ones apart; only touched by whoever's compiling
+        CodeCache* cache = nullptr;
+        std::unordered_map<u64, u64> frames_by_hash;
+
+        // Everything below is only to be touched with the mutex held
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::queue<Job> jobs;
+        std::vector<Result> results;
+        Statistics statistics;
+        bool is_stopping = false;
+    };
+
+    struct Options
+    {
+        // Number of times a frame has to run before it's re-optimised, or 0
+        // to never bother
+        u64 hot_threshold = 1000;
+
+        // Print how long was spent compiling each tier on exit
+        bool print_statistics = false;
+
+        // Leave compiling to a background thread, interpreting in the
+        // meantime, rather than waiting on each frame as it's needed
+        bool background_compilation = true;
+
+        // Keep compiled frames here to be reused by later runs, if anywhere
+        std::optional<std::string> cache_directory;
+
+        // Bytes of generated code to keep before the least recently used
+        // frames are thrown away, or 0 for no limit
+        u64 code_budget = 0;
+
+        // Describe each frame in /tmp/perf-<pid>.map for perf to find
+        bool write_perf_map = false;
+    };
+
+    void init(
+        CPU& cpu,
+        const Options& options = {}
+    );
+    u64 run_next_frame(
+        CPU& cpu
+    );
+    Frame* compile_next_frame(
         CPU& cpu
     );
-    std::optional<Frame> compile_next_frame(
+    void queue_next_frame(
         CPU& cpu
     );
+    std::optional<std::vector<FrameInstruction>> fetch_frame(
+        CPU& cpu
+    );
+    FrameCode compile_frame(
+        CPU& cpu,
+        CompileQueue& queue,
+        std::vector<FrameInstruction>& instructions,
+        Frame* frame
+    );
     void execute_frame(
         CPU& cpu,
         Frame& frame,
         u64 pc
     );
+    void discard_fp_exceptions();
+    void collect_fp_exceptions(
+        CPU& cpu
+    );
     void cache_frame(
-        Frame& frame
+        Frame* frame
     );
+    void evict_cold_frames();
     bool check_for_exceptions(
         CPU& cpu
     );
-    std::optional<Frame> get_cached_frame(
+    Frame* get_cached_frame(
+        CPU& cpu,
         u64 pc
     );
+    bool is_frame_pending(
+        CPU& cpu,
+        u64 pc
+    );
+    Frame* find_frame(
+        const std::vector<Frame*>& frames,
+        u64 pc,
+        u64 physical_pc
+    );
+    void invalidate_written_frames(
+        CPU& cpu
+    );
+    void free_frame(
+        Frame* frame
+    );
+    void link_static_exits(
+        Context& context,
+        llvm::Module* module,
+        const std::unordered_map<u64, llvm::BasicBlock*>& label_map,
+        u64 starting_pc
+    );
+    void count_execution(
+        Context& context
+    );
+    llvm::Value* flush_instruction_count(
+        Context& context
+    );
+    void sync_instruction_count(
+        Context& context,
+        llvm::Function* function
+    );
+    void sync_promoted_registers(
+        Context& context,
+        llvm::Function* function
+    );
+    bool may_access_registers(
+        Context& context,
+        llvm::CallInst* call
+    );
+    void chain_frames(
+        CPU& cpu,
+        u64* slot,
+        u64 target
+    );
+    void unchain_frame(
+        Frame* frame
+    );
     void register_interface_functions(
         llvm::Module* module,
         llvm::LLVMContext& context,
         Context& jit_context
     );
     void link_interface_functions(
-        llvm::ExecutionEngine* engine,
-        Context& jit_context
+        llvm::orc::LLJIT& session,
+        CPU& cpu
+    );
+    void write_perf_map_entry(
+        const CompileQueue& queue,
+        const FrameCode& code,
+        const std::vector<FrameInstruction>& instructions
+    );
+    u64 get_function_size(
+        const llvm::MemoryBuffer& object
+    );
+    std::string name_frame(
+        CompileQueue& queue,
+        llvm::Module* module
+    );
+    void queue_hot_frames(
+        CPU& cpu
+    );
+    std::vector<FrameInstruction> form_trace(
+        Frame* frame
+    );
+    void install_baseline_frames();
+    void install_optimised_frames();
+    std::vector<CompileQueue::Result> take_compiled_frames(
+        CompileQueue& queue
+    );
+    void start_compiler(
+        CompileQueue& queue
+    );
+    void stop_compiler(
+        CompileQueue& queue
+    );
+    void run_compiler(
+        CompileQueue* queue
+    );
+    void optimise_module(
+        llvm::Module& module
     );
+    void shut_down();
     bool emit_instruction(
         CPU& cpu,
         Context& context
@@ -113,7 +440,7 @@ namespace JIT
         Context& context
     );
 
-    llvm::Value* get_registers(CPU& cpu, llvm::IRBuilder<>& builder);
+    llvm::Value* get_cpu_field(CPU& cpu, llvm::IRBuilder<>& builder, llvm::Module* module, const void* field, llvm::Type* type);
     llvm::Value* load_register(Context& context, u32 index);
     void store_register(Context& context, u32 index, llvm::Value* value);
 ;}
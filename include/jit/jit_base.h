@@ -56,6 +56,7 @@ namespace JIT
     void mret       (Context& context);
     void wfi        (Context& context);
     void sfence_vma (Context& context);
+    void fence_i    (Context& context);
 
     void lwu        (Context& context);
     void ld         (Context& context);
@@ -0,0 +1,40 @@
+#pragma once
+#include "common.h"
+#include "jit/llvm.h"
+
+namespace JIT
+{
+    /*
+        Keeps compiled frames on disk so that booting the same image again
+        doesn't mean compiling it all over again. Objects are filed under the
+        module's identifier, which compile_frame derives from a hash of the IR
+        (so everything that went into translating it, and the guest code it
+        was translated from). Objects are only good for the LLVM and host CPU
+        they were built by and the tier's code generation options, so each
+        combination gets a directory of its own.
+
+        ORC may compile on either tier's thread, so this must be thread safe.
+    */
+    class CodeCache : public llvm::ObjectCache
+    {
+    public:
+        CodeCache(
+            const std::filesystem::path& root,
+            const std::string& tier
+        );
+
+        void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override;
+        std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override;
+
+        // So that the optimiser doesn't bother with modules it won't compile
+        bool contains(const llvm::Module& module) const;
+
+        std::atomic<u64> hits = 0;
+        std::atomic<u64> misses = 0;
+
+    private:
+        std::filesystem::path get_path(const llvm::Module& module) const;
+
+        std::filesystem::path directory;
+    };
+}
@@ -43,6 +43,45 @@ static void fall_back(llvm::Function* function, JIT::Context& context, bool is_c
     root->insert(root->end(), success_block);
     context.builder.SetInsertPoint(success_block);
 }
+
+/*
+    For instructions that are done natively in the common case; anything else
+    (usually an exception to raise) is left to the interpreter when condition
+    doesn't hold at runtime.
+*/
+template<typename F>
+void emit_or_fall_back(
+    JIT::Context& context,
+    llvm::Value* condition,
+    llvm::Function* function,
+    F&& emit,
+    bool is_compressed = false
+)
+{
+    llvm::Function* root = context.builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock* native_block = llvm::BasicBlock::Create(context.context);
+    llvm::BasicBlock* interpreter_block = llvm::BasicBlock::Create(context.context);
+    llvm::BasicBlock* done_block = llvm::BasicBlock::Create(context.context);
+    context.builder.CreateCondBr(
+        condition,
+        native_block,
+        interpreter_block,
+        llvm::MDBuilder(context.context).createBranchWeights(1000, 1)
+    );
+
+    root->insert(root->end(), interpreter_block);
+    context.builder.SetInsertPoint(interpreter_block);
+    fall_back(function, context, is_compressed);
+    context.builder.CreateBr(done_block);
+
+    root->insert(root->end(), native_block);
+    context.builder.SetInsertPoint(native_block);
+    emit(context);
+    context.builder.CreateBr(done_block);
+
+    root->insert(root->end(), done_block);
+    context.builder.SetInsertPoint(done_block);
+}
 #endif
 
 inline llvm::Value* sign_extend_32_as_64(JIT::Context& context, llvm::Value* value)
@@ -69,58 +108,149 @@ inline llvm::Value* zero_extend(JIT::Context& context, llvm::Value* value)
     );
 }
 
+/*
+    Probes one of the CPU's fast TLBs (see CPU::FastTLBEntry), branching to
+    hit_block if the address is naturally aligned and its page is in there, or
+    miss_block if not. Returns where the address lives in host memory, which
+    only makes sense on a hit.
+*/
+inline llvm::Value* probe_fast_tlb(
+    JIT::Context& context,
+    llvm::Value* fast_tlb,
+    llvm::Value* address,
+    u64 size,
+    llvm::BasicBlock* hit_block,
+    llvm::BasicBlock* miss_block
+)
+{
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Type* i64 = builder.getInt64Ty();
+    llvm::StructType* entry_type = llvm::StructType::get(i64, i64);
+
+    llvm::Value* page = builder.CreateLShr(address, u64_im(12));
+    llvm::Value* index = builder.CreateAnd(page, u64_im(CPU::fast_tlb_size - 1));
+    llvm::Value* entry = builder.CreateInBoundsGEP(entry_type, fast_tlb, index);
+    llvm::Value* entry_page = builder.CreateLoad(i64, builder.CreateStructGEP(entry_type, entry, 0));
+    llvm::Value* host_addend = builder.CreateLoad(i64, builder.CreateStructGEP(entry_type, entry, 1));
+
+    // Misaligned accesses might cross into another page
+    llvm::Value* is_aligned = builder.CreateICmpEQ(builder.CreateAnd(address, u64_im(size - 1)), u64_im(0));
+    llvm::Value* is_hit = builder.CreateAnd(builder.CreateICmpEQ(entry_page, page), is_aligned);
+    builder.CreateCondBr(
+        is_hit,
+        hit_block,
+        miss_block,
+        llvm::MDBuilder(context.context).createBranchWeights(1000, 1)
+    );
+
+    return builder.CreateAdd(address, host_addend);
+}
+
 template<typename F>
 llvm::Value* perform_load(JIT::Context& context, llvm::Function* f, F&& get_address)
 {
-    const auto bool_type = llvm::Type::getInt1Ty(context.context);
-    llvm::Value* did_succeed_ptr = context.builder.CreateAlloca(bool_type);
-    llvm::Value* result = context.builder.CreateCall(f, {
-        get_address(context),
-        u64_im(context.pc),
-        did_succeed_ptr
-    });
-    llvm::Value* did_succeed = context.builder.CreateLoad(bool_type, did_succeed_ptr);
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Function* function = builder.GetInsertBlock()->getParent();
+    llvm::Type* type = f->getReturnType();
+    llvm::Value* address = get_address(context);
 
-    // Return early on failure
-    llvm::Function* function = context.builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock* hit_block = llvm::BasicBlock::Create(context.context);
+    llvm::BasicBlock* miss_block = llvm::BasicBlock::Create(context.context);
     llvm::BasicBlock* success_block = llvm::BasicBlock::Create(context.context);
     llvm::BasicBlock* failure_block = llvm::BasicBlock::Create(context.context);
-    context.builder.CreateCondBr(did_succeed, success_block, failure_block);
+    llvm::Value* host_address = probe_fast_tlb(
+        context,
+        context.fast_load_tlb,
+        address,
+        type->getPrimitiveSizeInBits() / 8,
+        hit_block,
+        miss_block
+    );
+
+    // Hit - straight from RAM
+    function->insert(function->end(), hit_block);
+    builder.SetInsertPoint(hit_block);
+    llvm::Value* fast_result = builder.CreateLoad(type, builder.CreateIntToPtr(host_address, type->getPointerTo()));
+    builder.CreateBr(success_block);
+
+    // Miss - the handler deals with MMIO, page walks, exceptions, etc. The
+    // one flag is shared by every load in the frame, and has to be in the
+    // entry block to be promoted to a register
+    if (context.load_succeeded == nullptr)
+    {
+        llvm::BasicBlock& entry = function->getEntryBlock();
+        llvm::IRBuilder<> entry_builder(&entry, entry.begin());
+        context.load_succeeded = entry_builder.CreateAlloca(builder.getInt1Ty());
+    }
+
+    function->insert(function->end(), miss_block);
+    builder.SetInsertPoint(miss_block);
+    llvm::Value* slow_result = builder.CreateCall(f, {
+        address,
+        u64_im(context.pc),
+        context.load_succeeded
+    });
+    llvm::Value* did_succeed = builder.CreateLoad(builder.getInt1Ty(), context.load_succeeded);
+    builder.CreateCondBr(did_succeed, success_block, failure_block);
 
     // Failure block - unable to JIT further (for now!) so return early
-    context.builder.SetInsertPoint(failure_block);
-    context.builder.CreateRet(u64_im(context.pc));
     function->insert(function->end(), failure_block);
+    builder.SetInsertPoint(failure_block);
+    builder.CreateRet(u64_im(context.pc));
 
     // Success block - carry on
     function->insert(function->end(), success_block);
-    context.builder.SetInsertPoint(success_block);
+    builder.SetInsertPoint(success_block);
+    llvm::PHINode* result = builder.CreatePHI(type, 2);
+    result->addIncoming(fast_result, hit_block);
+    result->addIncoming(slow_result, miss_block);
     return result;
 }
 
 template<typename F>
 void perform_store(JIT::Context& context, llvm::Function* f, llvm::Value* value, F get_address)
 {
-    llvm::Value* did_succeed = context.builder.CreateCall(f, {
-        get_address(context),
-        value,
-        u64_im(context.pc)
-    });
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Function* function = builder.GetInsertBlock()->getParent();
+    llvm::Value* address = get_address(context);
 
-    // Return early on failure
-    llvm::Function* function = context.builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock* hit_block = llvm::BasicBlock::Create(context.context);
+    llvm::BasicBlock* miss_block = llvm::BasicBlock::Create(context.context);
     llvm::BasicBlock* success_block = llvm::BasicBlock::Create(context.context);
     llvm::BasicBlock* failure_block = llvm::BasicBlock::Create(context.context);
-    context.builder.CreateCondBr(did_succeed, success_block, failure_block);
+    llvm::Value* host_address = probe_fast_tlb(
+        context,
+        context.fast_store_tlb,
+        address,
+        value->getType()->getPrimitiveSizeInBits() / 8,
+        hit_block,
+        miss_block
+    );
+
+    // Hit - straight to RAM
+    function->insert(function->end(), hit_block);
+    builder.SetInsertPoint(hit_block);
+    builder.CreateStore(value, builder.CreateIntToPtr(host_address, value->getType()->getPointerTo()));
+    builder.CreateBr(success_block);
+
+    // Miss - leave it to the handler
+    function->insert(function->end(), miss_block);
+    builder.SetInsertPoint(miss_block);
+    llvm::Value* did_succeed = builder.CreateCall(f, {
+        address,
+        value,
+        u64_im(context.pc)
+    });
+    builder.CreateCondBr(did_succeed, success_block, failure_block);
 
     // Failure block - unable to JIT further (for now!) so return early
-    context.builder.SetInsertPoint(failure_block);
-    context.builder.CreateRet(u64_im(context.pc));
     function->insert(function->end(), failure_block);
+    builder.SetInsertPoint(failure_block);
+    builder.CreateRet(u64_im(context.pc));
 
     // Success block - carry on
-    context.builder.SetInsertPoint(success_block);
     function->insert(function->end(), success_block);
+    builder.SetInsertPoint(success_block);
 }
 
 inline void create_non_terminating_return(JIT::Context& context, llvm::Value* pc, llvm::Value* condition = nullptr)
@@ -141,6 +271,26 @@ inline void create_non_terminating_return(JIT::Context& context, llvm::Value* pc
     root->insert(root->end(), failure_block);
 }
 
+inline void create_static_exit(JIT::Context& context, u64 pc, llvm::Value* condition = nullptr)
+{
+    // Like create_non_terminating_return, but as the target is known at
+    // compile time the exit can later be linked to other code (see
+    // JIT::link_static_exits)
+    if (condition == nullptr)
+        condition = llvm::ConstantInt::getTrue(context.context);
+
+    llvm::Function* root = context.builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock* exit_block = llvm::BasicBlock::Create(context.context);
+    llvm::BasicBlock* continue_block = llvm::BasicBlock::Create(context.context);
+    context.builder.CreateCondBr(condition, exit_block, continue_block);
+
+    root->insert(root->end(), exit_block);
+    context.static_exits.push_back({ exit_block, pc });
+
+    context.builder.SetInsertPoint(continue_block);
+    root->insert(root->end(), continue_block);
+}
+
 inline void call_handler_and_return(JIT::Context& context, llvm::Function* f)
 {
     create_non_terminating_return(
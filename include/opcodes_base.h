@@ -91,8 +91,6 @@
 #define SRLW    0x000 // funct7; funct3 (0x5) same as sraiw
 #define SRAW    0x020 // funct7; funct3 (0x5) same as srliw
 
-bool opcodes_base(CPU& cpu, const Instruction instruction);
-
 void add        (CPU& cpu, const Instruction instruction);
 void sub        (CPU& cpu, const Instruction instruction);
 void _xor       (CPU& cpu, const Instruction instruction);
@@ -144,6 +142,7 @@ void sret       (CPU& cpu, const Instruction instruction);
 void mret       (CPU& cpu, const Instruction instruction);
 void wfi        (CPU& cpu, const Instruction instruction);
 void sfence_vma (CPU& cpu, const Instruction instruction);
+void fence_i    (CPU& cpu, const Instruction instruction);
 
 void lwu        (CPU& cpu, const Instruction instruction);
 void ld         (CPU& cpu, const Instruction instruction);
@@ -88,6 +88,7 @@ class CPU;
 
 void init_opcodes_f();
 bool check_fs_field(CPU& cpu, bool is_write);
+void update_fcsr_flags(CPU& cpu);
 bool opcodes_f(CPU& cpu, const Instruction instruction);
 
 void flw        (CPU& cpu, const Instruction instruction);
@@ -21,8 +21,6 @@
 #define REMW                0b110
 #define REMUW               0b111
 
-bool opcodes_m(CPU& cpu, const Instruction instruction);
-
 void mul    (CPU& cpu, const Instruction instruction);
 void mulh   (CPU& cpu, const Instruction instruction);
 void mulhsu (CPU& cpu, const Instruction instruction);
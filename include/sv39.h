@@ -52,6 +52,8 @@ struct PhysicalAddress : Address
 
 struct PageTableEntry : Address
 {
+    static constexpr u8 d_bit = 1 << 7;
+
     PageTableEntry(const u64 address) : Address(address) {}
 
     u8 get_v() const { return (address >> 0) & 0b1; }
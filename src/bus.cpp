@@ -7,7 +7,7 @@ Bus::Bus(
     const std::optional<std::string> block_device_image,
     const bool is_test_mode
 ) : ram(ram_size), uart(!is_test_mode), block_device(block_device_image),
-    is_test_mode(is_test_mode) {}
+    is_test_mode(is_test_mode), code_pages(ram_size / code_page_size, false) {}
 
 #define READ_X(x) std::optional<u##x> Bus::read_##x(const u64 address)\
 {\
@@ -22,6 +22,7 @@ READ_X(64)
 
 #define WRITE_X(x) bool Bus::write_##x(const u64 address, const u##x value)\
 {\
+    check_for_code_write(address, x / 8);\
     std::pair<BusDevice&, u64> device_info = get_bus_device(address, x / 8);\
     return device_info.first.write_##x(address - device_info.second, value);\
 }
@@ -42,9 +43,31 @@ size_t Bus::write_file(const u64 address, const std::string& filename)
     return file.second;
 }
 
-void Bus::clock(CPU& cpu, bool is_jit)
+void Bus::mark_code_page(const u64 address)
 {
-    clint.increment(cpu);
+    const u64 page = (address - ram_base) / code_page_size;
+    if (address >= ram_base && page < code_pages.size())
+        code_pages[page] = true;
+}
+
+void Bus::note_code_write(const u64 address)
+{
+    code_pages[(address - ram_base) / code_page_size] = false;
+    written_code_pages.push_back(address / code_page_size);
+    ++code_writes;
+}
+
+u8* Bus::get_host_page(const u64 page_address)
+{
+    if (page_address >= ram_base && page_address + 4096 <= ram_base + ram.size)
+        return ram.get_host_address(page_address - ram_base);
+
+    return nullptr;
+}
+
+void Bus::clock(CPU& cpu, bool is_jit, u64 cycles)
+{
+    clint.increment(cpu, cycles);
 
     // The CLINT is pretty sensitive to not being called every cycle (Linux
     // will hang), but UART and the PLIC don't need to be called every clock
@@ -52,7 +75,9 @@ void Bus::clock(CPU& cpu, bool is_jit)
     // every so often shaves about 1 second of Linux's (currently) 13 second
     // boot time.
 
-    if (((++clock_counter) % 1024) == 0 || is_jit)
+    const u64 previous_clock_counter = clock_counter;
+    clock_counter += cycles;
+    if (clock_counter / 1024 != previous_clock_counter / 1024 || is_jit)
     {
         uart.clock(plic);
         block_device.clock(cpu, plic);
@@ -42,62 +42,251 @@ CPU::CPU(
     // Init floats
     float_registers = FloatRegisters(this);
     init_opcodes_f();
+
+    build_tlb_permissions();
 }
 
 void CPU::do_cycle()
 {
-    // Check is 16-bit aligned (32 if RVC weren't supported)
-    if ((pc & 0b1) != 0)
-    {
-        raise_exception(Exception::InstructionAddressMisaligned, pc);
+    const DecodedInstruction* decoded = get_decoded_instruction();
+    if (decoded == nullptr)
         return;
+
+    // Reset x0
+    registers[0] = 0;
+
+    // Seems to be a valid instruction - try and execute it
+    decoded->handler(*this, decoded->instruction);
+
+    mcycle.increment(*this);
+    minstret.increment(*this);
+    time.increment(*this);
+}
+
+u64 CPU::run_block()
+{
+    const DecodedInstruction* decoded = get_decoded_instruction();
+    if (decoded == nullptr)
+        return 0;
+
+    // Leave in time for the timer, unless it's already gone off
+    const DecodedInstruction* const start = decoded;
+    const DecodedInstruction* end = current_block->instructions.data() + current_block->instructions.size();
+    const u64 cycles_until_timer = bus.get_cycles_until_timer();
+    if (cycles_until_timer != 0 && cycles_until_timer < (u64)(end - start))
+        end = start + cycles_until_timer;
+
+    // Nothing in a block but its last instruction changes control flow, so
+    // it's just one handler after another until something needs attention
+    const u64 code_writes = bus.code_writes;
+    do
+    {
+        registers[0] = 0;
+        decoded->handler(*this, decoded->instruction);
+        ++decoded;
     }
+    while (decoded != end && !pending_trap.has_value() && bus.code_writes == code_writes);
 
-    // Check if instruction is of compressed form
-    const std::expected<CompressedInstruction, Exception> half_instruction = read_16(pc, AccessType::Instruction);
-    const bool is_compressed = (half_instruction.has_value() && (half_instruction->instruction & 0b11) != 0b11);
+    // Carry on from here next time, unless there's a trap to take first
+    next_decoded_index = decoded - current_block->instructions.data();
+    next_decoded_pc = pc;
+    if (pending_trap.has_value())
+        current_block = nullptr;
 
-    // Else fetch regular instruction
-    std::expected<Instruction, Exception> instruction = std::unexpected(Exception::IllegalInstruction);
-    if (!is_compressed) instruction = read_32(pc, AccessType::Instruction);
-    if (!is_compressed && !instruction)
-    {
-        // Exception information needs the vaddr of the portion of the
-        // instruction that caused the fault
-        u64 faulty_address = pc;
-        if (!read_8(pc)) faulty_address = pc;
-        else if (!read_8(pc + 1)) faulty_address = pc + 1;
-        else if (!read_8(pc + 1)) faulty_address = pc + 2;
-        else faulty_address = pc + 3;
-
-        raise_exception(instruction.error(), faulty_address);
-        return;
+    return decoded - start;
+}
+
+const CPU::DecodedInstruction* CPU::get_decoded_instruction()
+{
+    // Anything decoded from a code page that's since been written could be
+    // stale
+    if (bus.code_writes != decoded_code_writes) [[unlikely]]
+    {
+        decoded_code_writes = bus.code_writes;
+        invalidate_written_blocks();
+
+        // The JIT has frames to throw away too, and lets go of the pages
+        // once it has (having had us do the same)
+        if (!bus.is_jit_enabled)
+            bus.written_code_pages.clear();
     }
 
-    // Check it's valid
-    if (!is_compressed &&
-        (instruction->instruction == 0xffffffff ||
-        instruction->instruction == 0))
+    // Carry on through the current block if nothing's jumped elsewhere,
+    // otherwise find (or decode) the one starting here
+    const auto is_current = [&](const DecodedBlock& block)
     {
-        raise_exception(Exception::IllegalInstruction, instruction->instruction);
+        return block.generation == decoded_generation &&
+            block.privilege_level == privilege_level &&
+            (block.is_global || block.asid == satp.get_asid());
+    };
+
+    DecodedBlock* block = current_block;
+    if (block == nullptr ||
+        pc != next_decoded_pc ||
+        next_decoded_index >= block->instructions.size() ||
+        !is_current(*block))
+    {
+        block = &decoded_blocks[(pc >> 1) % decoded_blocks_size];
+        if (block->pc != pc || !is_current(*block))
+            block = decode_block();
+
+        current_block = block;
+        next_decoded_index = 0;
+        if (block == nullptr)
+            return nullptr;
+    }
+
+    const DecodedInstruction* decoded = &block->instructions[next_decoded_index++];
+    next_decoded_pc = pc + decoded->length;
+    return decoded;
+}
+
+void CPU::invalidate_written_blocks()
+{
+    // Just the one pass over the blocks, however many pages were written
+    // (and however many times)
+    const std::unordered_set<u64> pages(bus.written_code_pages.begin(), bus.written_code_pages.end());
+    if (pages.empty())
         return;
+
+    for (DecodedBlock& block : decoded_blocks)
+    {
+        if (block.pc != DecodedBlock::invalid_pc &&
+            (pages.contains(block.physical_pages[0]) || pages.contains(block.physical_pages[1])))
+            block.pc = DecodedBlock::invalid_pc;
     }
-    else if (is_compressed && half_instruction->instruction == 0x0000)
+
+    // It might've been the one that's running
+    current_block = nullptr;
+}
+
+// Anything that might not go on to the next instruction, or might change
+// how the rest are fetched
+static bool ends_decoded_block(const u32 instruction, const bool is_compressed)
+{
+    if (is_compressed)
     {
-        raise_exception(Exception::IllegalInstruction, half_instruction->instruction);
-        return;
+        const u32 quadrant = instruction & 0b11;
+        const u32 funct3 = (instruction >> 13) & 0b111;
+        return (quadrant == 0b01 && (funct3 == 0b101 || funct3 == 0b110 || funct3 == 0b111)) ||
+               (quadrant == 0b10 && funct3 == 0b100);
     }
 
-    // Reset x0
-    registers[0] = 0;
+    switch (instruction & 0x7f)
+    {
+        case 0b1101111: // JAL
+        case 0b1100111: // JALR
+        case 0b1100011: // Branches
+        case 0b1110011: // System
+        case 0b0001111: // Fences
+            return true;
+        default:
+            return false;
+    }
+}
 
-    // Seems to be a valid instruction - try and execute it
-    if (is_compressed) execute_compressed_instruction(*half_instruction);
-    else execute_instruction(*instruction);
+CPU::DecodedBlock* CPU::decode_block()
+{
+    const u64 page_size = 4096;
 
-    mcycle.increment(*this);
-    minstret.increment(*this);
-    time.increment(*this);
+    // Check is 16-bit aligned (32 if RVC weren't supported)
+    if ((pc & 0b1) != 0)
+    {
+        raise_exception(Exception::InstructionAddressMisaligned, pc);
+        return nullptr;
+    }
+
+    DecodedBlock& block = decoded_blocks[(pc >> 1) % decoded_blocks_size];
+    block.pc = DecodedBlock::invalid_pc;
+    block.physical_pages = { DecodedBlock::invalid_pc, DecodedBlock::invalid_pc };
+    block.instructions.clear();
+
+    // Only the first instruction raises exceptions; later ones that can't be
+    // fetched just end the block, and get their turn when they're reached
+    u64 address = pc;
+    while (block.instructions.size() < decoded_block_limit)
+    {
+        const bool is_first = block.instructions.empty();
+
+        // Check if instruction is of compressed form
+        const std::expected<CompressedInstruction, Exception> half_instruction = read_16(address, AccessType::Instruction);
+        const bool is_compressed = (half_instruction.has_value() && (half_instruction->instruction & 0b11) != 0b11);
+
+        // Else fetch regular instruction, which only the first may do across
+        // a page boundary
+        std::expected<Instruction, Exception> instruction = std::unexpected(Exception::IllegalInstruction);
+        if (!is_compressed && !is_first && address % page_size > page_size - sizeof(u32))
+            break;
+        if (!is_compressed) instruction = read_32(address, AccessType::Instruction);
+        if (!is_compressed && !instruction)
+        {
+            if (!is_first)
+                break;
+
+            // Exception information needs the vaddr of the portion of the
+            // instruction that caused the fault
+            u64 faulty_address = pc;
+            if (!read_8(pc)) faulty_address = pc;
+            else if (!read_8(pc + 1)) faulty_address = pc + 1;
+            else if (!read_8(pc + 1)) faulty_address = pc + 2;
+            else faulty_address = pc + 3;
+
+            raise_exception(instruction.error(), faulty_address);
+            return nullptr;
+        }
+
+        // Check it's valid
+        const u32 raw = is_compressed ? half_instruction->instruction : instruction->instruction;
+        if ((!is_compressed && (raw == 0xffffffff || raw == 0)) ||
+            (is_compressed && raw == 0x0000))
+        {
+            if (!is_first)
+                break;
+
+            raise_exception(Exception::IllegalInstruction, raw);
+            return nullptr;
+        }
+
+        const u8 length = is_compressed ? sizeof(u16) : sizeof(u32);
+        block.instructions.push_back({
+            is_compressed ? decode_compressed_instruction(raw) : decode_instruction(raw),
+            raw,
+            length
+        });
+        address += length;
+
+        // Straddled a page; writes to the second need watching too
+        if (address % page_size != 0 && address % page_size < length)
+        {
+            if (const auto physical_address = translate_instruction_address(address - 1))
+            {
+                protect_code_page(*physical_address);
+                block.physical_pages[1] = *physical_address / page_size;
+            }
+            break;
+        }
+
+        if (ends_decoded_block(raw, is_compressed) || address % page_size == 0)
+            break;
+    }
+
+    // Having just been fetched from, this will come straight from the TLB
+    if (const auto physical_address = translate_instruction_address(pc))
+    {
+        protect_code_page(*physical_address);
+        block.physical_pages[0] = *physical_address / page_size;
+    }
+
+    // Blocks from global mappings (or without translation) are good for any
+    // address space
+    block.pc = pc;
+    block.generation = decoded_generation;
+    block.privilege_level = privilege_level;
+    block.asid = satp.get_asid();
+    const TLBEntry* entry = find_tlb_entry(pc / page_size, AccessType::Instruction);
+    block.is_global = paging_disabled(AccessType::Instruction) ||
+        (entry != nullptr && entry->is_global);
+    return &block;
 }
 
 void CPU::trace()
@@ -237,7 +426,7 @@ void CPU::handle_trap(const u64 cause, const u64 info, const bool interrupt)
         mstatus.fields.mpp = (u64)original_privilege_level;
     }
 
-    check_for_invalid_tlb();
+    update_tlb_permissions();
 }
 
 u64 CPU::get_exception_cause(const Exception exception)
@@ -271,82 +460,100 @@ u64 CPU::get_exception_cause(const Exception exception)
     };
 }
 
-void CPU::execute_instruction(const Instruction instruction)
+void CPU::invalidate_tlb()
 {
-    const u8 opcode = instruction.get_opcode();
-    const u8 funct3 = instruction.get_funct3();
-    const u8 funct7 = instruction.get_funct7();
+    instruction_tlb.fill({});
+    data_tlb.fill({});
+    page_walk_cache = {};
+    tlb_was_flushed = true;
+    fast_load_tlb.fill({});
+    fast_store_tlb.fill({});
+}
 
-    // Decode - try base cases first because ECALL and ZICSR overlap
-    bool did_find_opcode = opcodes_base(*this, instruction);
-    if (!did_find_opcode)
+void CPU::invalidate_tlb(const std::optional<u64> address, const std::optional<u64> asid)
+{
+    const u64 page_size = 4096;
+    if (!address.has_value() && !asid.has_value())
     {
-        switch(opcode)
-        {
-            case OPCODES_ZICSR:
-                did_find_opcode = opcodes_zicsr(*this, instruction);
-                break;
+        invalidate_tlb();
+        invalidate_decoded_blocks();
+        return;
+    }
 
-            case OPCODES_M:
-            case OPCODES_M_32:
-                // Distinguished from OPCODES_BASE_R_TYPE[_32] by funct7
-                if (funct7 == OPCODES_M_FUNCT_7)
-                    did_find_opcode = opcodes_m(*this, instruction);
-                break;
+    const std::optional<u64> virtual_page =
+        address.has_value() ? std::optional<u64>(*address / page_size) : std::nullopt;
+    const auto is_flushed = [&](const u64 page, const u64 entry_asid, const bool is_global)
+    {
+        return (!virtual_page.has_value() || page == *virtual_page) &&
+            (!asid.has_value() || (entry_asid == *asid && !is_global));
+    };
 
-            case OPCODES_A:
-                did_find_opcode = opcodes_a(*this, instruction);
-                break;
+    // Superpages go if they cover the page at all
+    const auto is_entry_flushed = [&](const TLBEntry& entry)
+    {
+        const u64 shift = get_tlb_page_shift(entry.level);
+        return entry.virtual_page != TLBEntry::invalid_page && is_flushed(
+            virtual_page.has_value() && (*virtual_page >> shift) == entry.virtual_page ?
+                *virtual_page : entry.virtual_page << shift,
+            entry.asid,
+            entry.is_global
+        );
+    };
 
-            case OPCODES_F_1:
-            case OPCODES_F_2:
-            case OPCODES_F_3:
-            case OPCODES_F_4:
-            case OPCODES_F_5:
-            case OPCODES_F_6:
-            case OPCODES_F_7:
-                did_find_opcode = opcodes_f(*this, instruction);
-                break;
+    // Non-leaf PTEs aren't tagged with either, and there's little enough of
+    // them that it's not worth working out which might be affected
+    page_walk_cache = {};
 
-            default:
-                break;
+    // A page can only be in the one place in each TLB for each page size
+    for (const AccessType type : { AccessType::Instruction, AccessType::Load })
+    {
+        if (virtual_page.has_value())
+        {
+            for (u64 level = 0; level < tlb_levels; ++level)
+            {
+                TLBEntry& entry = get_tlb_entry(*virtual_page, level, type);
+                if (entry.level == level && is_entry_flushed(entry))
+                    entry = {};
+            }
+        }
+        else
+        {
+            auto& tlb = (type == AccessType::Instruction) ? instruction_tlb : data_tlb;
+            for (TLBEntry& entry : tlb)
+                if (is_entry_flushed(entry))
+                    entry = {};
         }
     }
 
-    if (!did_find_opcode)
-        throw std::runtime_error(std::format(
-            "unknown opcode 0x{:x} with funct3 0x{:x}, funct7 0x{:x}, rs2 0x{:x} - raw = 0x{:x}, pc = 0x{:x}",
-            opcode,
-            funct3,
-            funct7,
-            instruction.get_rs2(),
-            instruction.instruction,
-            pc
-        ));
-
-    if (!pending_trap.has_value())
-        pc += sizeof(u32);
-}
+    // Blocks are tagged the same way, with one that starts with an instruction
+    // straddling pages being on both
+    for (DecodedBlock& block : decoded_blocks)
+    {
+        if (block.pc != DecodedBlock::invalid_pc &&
+            (is_flushed(block.pc / page_size, block.asid, block.is_global) ||
+            is_flushed((block.pc + sizeof(u16)) / page_size, block.asid, block.is_global)))
+            block.pc = DecodedBlock::invalid_pc;
+    }
 
-void CPU::execute_compressed_instruction(const CompressedInstruction instruction)
-{
-    if (!opcodes_c(*this, instruction))
-        throw std::runtime_error(std::format(
-            "unknown opcode 0x{:x} with funct3 0x{:x} - raw = 0x{:x}, pc = 0x{:x}",
-            instruction.get_opcode(),
-            instruction.get_funct3(),
-            instruction.instruction,
-            pc
-        ));
-
-    if (!pending_trap.has_value())
-        pc += sizeof(u16);
+    // The fast TLBs aren't tagged at all, and the JIT's jump cache only by
+    // ASID, so it's thrown away as usual
+    if (virtual_page.has_value() && !asid.has_value())
+    {
+        fast_load_tlb[*virtual_page % fast_tlb_size] = {};
+        fast_store_tlb[*virtual_page % fast_tlb_size] = {};
+    }
+    else
+    {
+        fast_load_tlb.fill({});
+        fast_store_tlb.fill({});
+    }
+    tlb_was_flushed = true;
 }
 
-void CPU::invalidate_tlb()
+void CPU::switch_address_space()
 {
-    tlb_entries = 0;
-    tlb_was_flushed = true;
+    fast_load_tlb.fill({});
+    fast_store_tlb.fill({});
 }
 
 std::expected<u64, Exception> CPU::tlb_lookup(
@@ -357,83 +564,187 @@ std::expected<u64, Exception> CPU::tlb_lookup(
     const u64 page_size = 4096;
     const u64 virtual_page = address / page_size;
 
-    // Check TLB first
-    for (size_t i = 0; i < tlb_entries; ++i)
-    {
-        const auto& entry = tlb[i];
-        if (entry.valid && entry.virtual_page == virtual_page && entry.access_type == type)
-        {
-            // Before we return the page, we must bear in mind that we are technically
-            // "accessing" it. Hence, the A and D bits must be dealt with accordingly.
-            // (see step 7 of the MMU)
-            PageTableEntry pte(entry.pte);
-            if (pte.get_a() == 0 || (type == AccessType::Store && pte.get_d() == 0))
-            {
-                if (type != AccessType::Trace)
-                {
-                    pte.set_a();
-                    if (type == AccessType::Store)
-                        pte.set_d();
-
-                    // TODO: PMA or PMP check
-                    if (emulating_test)
-                        dbg("TODO: pma or pmp MMU check missed");
-
-                    // Update PTE value
-                    std::ignore = bus.write_64(entry.pte_address, pte.address);
-                }
-            }
+    // Tracing mustn't have any side effects, so doesn't touch the TLB
+    if (type == AccessType::Trace)
+        return virtual_address_to_physical(address, type);
 
-            return entry.physical_page * page_size + (address % page_size);
-        }
-    }
+    // Check TLB first
+    const TLBEntry* entry = find_tlb_entry(virtual_page, type);
+    if (entry != nullptr && is_tlb_allowed(*entry, type))
+        return entry->physical_page * page_size + get_tlb_offset(*entry, address);
 
     // Failed; perform proper lookup
     const auto result = virtual_address_to_physical(address, type);
     return result;
 }
 
+std::expected<u64, Exception> CPU::translate_instruction_address(const u64 address)
+{
+    if (paging_disabled(AccessType::Instruction))
+        return address;
+
+    return tlb_lookup(address, AccessType::Instruction);
+}
+
+void CPU::fill_fast_tlb(const u64 address, const AccessType type)
+{
+    const u64 page_size = 4096;
+    assert(type == AccessType::Load || type == AccessType::Store);
+
+    // Having just been accessed, this will come straight from the TLB
+    const std::expected<u64, Exception> physical_address =
+        paging_disabled(type) ? address : tlb_lookup(address, type);
+    if (!physical_address.has_value())
+        return;
+
+    u8* host_page = bus.get_host_page(*physical_address / page_size * page_size);
+    if (host_page == nullptr)
+        return;
+
+    // Writes to code have to be noticed by the bus
+    if (type == AccessType::Store && bus.is_code_page(*physical_address))
+        return;
+
+    const u64 virtual_page = address / page_size;
+    auto& fast_tlb = (type == AccessType::Load) ? fast_load_tlb : fast_store_tlb;
+    fast_tlb[virtual_page % fast_tlb_size] = {
+        virtual_page,
+        reinterpret_cast<u64>(host_page) - virtual_page * page_size
+    };
+}
+
+void CPU::protect_code_page(const u64 physical_address)
+{
+    const u64 page_size = 4096;
+    if (bus.is_code_page(physical_address))
+        return;
+
+    bus.mark_code_page(physical_address);
+    const u8* host_page = bus.get_host_page(physical_address / page_size * page_size);
+    if (host_page == nullptr)
+        return;
+
+    // Whatever virtual pages it's mapped to
+    for (FastTLBEntry& entry : fast_store_tlb)
+    {
+        if (entry.virtual_page != FastTLBEntry::invalid_page &&
+            entry.host_addend + entry.virtual_page * page_size == reinterpret_cast<u64>(host_page))
+            entry = {};
+    }
+    // (superpages check for themselves; see get_host_address)
+    for (TLBEntry& entry : data_tlb)
+    {
+        if (entry.virtual_page != TLBEntry::invalid_page && entry.level == 0 &&
+            entry.physical_page == physical_address / page_size)
+            entry.pte_flags &= ~PageTableEntry::d_bit;
+    }
+}
+
 void CPU::add_tlb_entry(
     const u64 virtual_page,
     const u64 physical_page,
     const PageTableEntry pte,
-    const u64 pte_address,
+    const u64 level,
     const AccessType type
 )
 {
-    // Evict oldest element if need be
-    if (tlb_entries == tlb.size())
-    {
-        for (size_t i = 0; i < tlb.size() - 1; ++i)
-            tlb[i] = tlb[i + 1];
+    const u64 page_size = 4096;
+    if (type == AccessType::Trace)
+        return;
 
-        tlb_entries--;
+    // A superpage only gets the one entry if it's all RAM or none of it is,
+    // as otherwise going through the bus would lose the host address for the
+    // part that is (e.g. a gigapage over less than a gigabyte of RAM)
+    u64 entry_level = level;
+    const u64 shift = get_tlb_page_shift(level);
+    const u64 first_page = physical_page >> shift << shift;
+    const u64 last_page = first_page + (1ull << shift) - 1;
+    u8* host_page = bus.get_host_page(first_page * page_size);
+    if ((host_page != nullptr) != (bus.get_host_page(last_page * page_size) != nullptr))
+    {
+        entry_level = 0;
+        host_page = bus.get_host_page(physical_page * page_size);
     }
 
-    tlb[tlb_entries].physical_page = physical_page;
-    tlb[tlb_entries].virtual_page = virtual_page;
-    tlb[tlb_entries].pte = pte.address;
-    tlb[tlb_entries].pte_address = pte_address;
-    tlb[tlb_entries].access_type = type;
-    tlb[tlb_entries].valid = true;
-    tlb_entries++;
+    // Stores to code pages mustn't hit, so those act as though never written
+    u8 pte_flags = pte.address & 0xff;
+    if (entry_level == 0 && bus.is_code_page(physical_page * page_size))
+        pte_flags &= ~PageTableEntry::d_bit;
+
+    const u64 entry_shift = get_tlb_page_shift(entry_level);
+    const u64 entry_virtual_page = virtual_page >> entry_shift;
+    get_tlb_entry(virtual_page, entry_level, type) = {
+        entry_virtual_page,
+        physical_page >> entry_shift << entry_shift,
+        reinterpret_cast<u64>(host_page) - (entry_virtual_page << entry_shift) * page_size,
+        satp.get_asid(),
+        pte_flags,
+        (u8)entry_level,
+        host_page != nullptr,
+        pte.get_g() == 1
+    };
 }
 
-void CPU::check_for_invalid_tlb()
+void CPU::update_tlb_permissions()
 {
     // Certain states modify page "permissions", like mstatus or the current privilege
-    // level. When these change, we can no longer assume that any previously cached
-    // translation is valid.
-
-    if (mstatus.fields.mxr != last_mstatus.fields.mxr ||
-        mstatus.fields.sum != last_mstatus.fields.sum ||
-        mstatus.fields.mprv != last_mstatus.fields.mprv ||
-        mstatus.fields.mpp != last_mstatus.fields.mpp ||
-        last_privilege_level != privilege_level)
-        invalidate_tlb();
+    // level. Cached translations stay as they are; only what they allow changes.
+    if (mstatus.fields.mxr == last_mstatus.fields.mxr &&
+        mstatus.fields.sum == last_mstatus.fields.sum &&
+        mstatus.fields.mprv == last_mstatus.fields.mprv &&
+        mstatus.fields.mpp == last_mstatus.fields.mpp &&
+        last_privilege_level == privilege_level)
+        return;
 
     last_privilege_level = privilege_level;
     last_mstatus = mstatus;
+    build_tlb_permissions();
+
+    // The fast TLBs have no permissions of their own
+    fast_load_tlb.fill({});
+    fast_store_tlb.fill({});
+}
+
+void CPU::build_tlb_permissions()
+{
+    // Steps 4 and 5 of the MMU, for every combination of PTE flags
+    for (u64 flags = 0; flags < tlb_permissions.size(); ++flags)
+    {
+        const PageTableEntry pte = flags;
+        u8 permissions = 0;
+
+        for (const AccessType type : { AccessType::Instruction, AccessType::Load, AccessType::Store })
+        {
+            const PrivilegeLevel privilege = effective_privilege_level(type);
+            const bool is_privileged =
+                pte.get_u() == 1 ?
+                    privilege == PrivilegeLevel::User || mstatus.fields.sum == 1 :
+                    privilege != PrivilegeLevel::User;
+            if (!is_privileged || pte.get_a() == 0)
+                continue;
+
+            bool is_allowed = false;
+            switch (type)
+            {
+                case AccessType::Instruction:
+                    is_allowed = pte.get_x() == 1;
+                    break;
+                case AccessType::Load:
+                    is_allowed = pte.get_r() == 1 || (mstatus.fields.mxr == 1 && pte.get_x() == 1);
+                    break;
+                case AccessType::Store:
+                    is_allowed = pte.get_w() == 1 && pte.get_d() == 1;
+                    break;
+                default:
+                    break;
+            }
+
+            if (is_allowed)
+                permissions |= get_tlb_permission(type);
+        }
+
+        tlb_permissions[flags] = permissions;
+    }
 }
 
 // Implements Sv39 paging - see RISC-V Instruction Set Manual Volume II - Privileged Architecture
@@ -450,7 +761,6 @@ std::expected<u64, Exception> CPU::virtual_address_to_physical(
     const auto vpns = va.get_vpns();
 
     PageTableEntry pte(0);
-    u64 pte_address;
 
     const auto appropriate_exception = [&](int number)
     {
@@ -488,10 +798,7 @@ std::expected<u64, Exception> CPU::virtual_address_to_physical(
         // 2. Let pte be the value of the PTE at address a+va.vpn[i]×PTESIZE.
         //    If accessing pte violates a PMA or PMP check, raise an access exception.
         // TODO: PMA and PMP checks
-        pte_address = a + vpns[i] * pte_size;
-        const auto pte_opt = bus.read_64(pte_address);
-        assert(pte_opt.has_value());
-        pte = PageTableEntry(*pte_opt);
+        pte = read_page_table_entry(a / page_size, vpns[i], i, type);
 
         // 3. If pte.v = 0, or if pte.r = 0 and pte.w = 1, stop and raise a page-fault exception.
         if (pte.get_v() == 0 || (pte.get_r() == 0 && pte.get_w() == 1))
@@ -605,21 +912,21 @@ std::expected<u64, Exception> CPU::virtual_address_to_physical(
         {
             u64 ppn = pte.get_ppn();
             u64 addr = (ppn << 12) | offset;
-            add_tlb_entry(address / page_size, addr / page_size, pte, pte_address, type);
+            add_tlb_entry(address / page_size, addr / page_size, pte, i, type);
             return addr;
         }
         case 1:
         {
             const auto ppns = pte.get_ppns();
             u64 addr = (ppns[2] << 30) | (ppns[1] << 21) | (vpns[0] << 12) | offset;
-            add_tlb_entry(address / page_size, addr / page_size, pte, pte_address, type);
+            add_tlb_entry(address / page_size, addr / page_size, pte, i, type);
             return addr;
         }
         case 2:
         {
             const auto ppns = pte.get_ppns();
             u64 addr = (ppns[2] << 30) | (vpns[1] << 21) | (vpns[0] << 12) | offset;
-            add_tlb_entry(address / page_size, addr / page_size, pte, pte_address, type);
+            add_tlb_entry(address / page_size, addr / page_size, pte, i, type);
             return addr;
         }
         default:
@@ -627,6 +934,45 @@ std::expected<u64, Exception> CPU::virtual_address_to_physical(
     }
 }
 
+PageTableEntry CPU::read_page_table_entry(
+    const u64 table_page,
+    const u64 vpn,
+    const i64 level,
+    const AccessType type
+)
+{
+    const u64 page_size = 4096;
+    const u64 pte_size = 8;
+
+    // Only the levels above the leaves are cached
+    PageWalkEntry* cached = nullptr;
+    if (level > 0)
+    {
+        cached = &page_walk_cache[level - 1][(table_page ^ vpn) % page_walk_cache_size];
+        if (cached->table_page == table_page && cached->vpn == vpn)
+            return cached->pte;
+    }
+
+    // Page tables are nearly always in RAM, which can be read directly
+    u64 value;
+    if (const u8* host_page = bus.get_host_page(table_page * page_size); host_page != nullptr)
+        memcpy(&value, host_page + vpn * pte_size, sizeof(value));
+    else
+    {
+        const std::optional<u64> bus_value = bus.read_64(table_page * page_size + vpn * pte_size);
+        assert(bus_value.has_value());
+        value = *bus_value;
+    }
+
+    // Leaves (and invalid PTEs) are left to the TLB
+    const PageTableEntry pte(value);
+    if (cached != nullptr && type != AccessType::Trace &&
+        pte.get_v() == 1 && pte.get_r() == 0 && pte.get_w() == 0 && pte.get_x() == 0)
+        *cached = { table_page, vpn, value };
+
+    return pte;
+}
+
 std::expected<u8,  Exception> CPU::read_8 (const u64 address, const AccessType type) { return read<u8> (address, type); }
 std::expected<u16, Exception> CPU::read_16(const u64 address, const AccessType type) { return read<u16>(address, type); }
 std::expected<u32, Exception> CPU::read_32(const u64 address, const AccessType type) { return read<u32>(address, type); }
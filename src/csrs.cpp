@@ -119,6 +119,36 @@ std::optional<u64> SIP::read(CPU& cpu)
     return new_value.bits;
 }
 
+bool MStatus::write(const u64 value, CPU& cpu)
+{
+    // Don't set the wpri fields; keep them zero (XS is read-only)
+    fields.mbe = (value >> 37) & 0x1;
+    fields.sbe = (value >> 36) & 0x1;
+    fields.tsr = (value >> 22) & 0x1;
+    fields.tw = (value >> 21) & 0x1;
+    fields.tvm = (value >> 20) & 0x1;
+    fields.mxr = (value >> 19) & 0x1;
+    fields.sum = (value >> 18) & 0x1;
+    fields.mprv = (value >> 17) & 0x1;
+    fields.fs = (value >> 13) & 0x3;
+    fields.mpp = (value >> 11) & 0x3;
+    fields.vs = (value >> 9) & 0x3;
+    fields.spp = (value >> 8) & 0x1;
+    fields.mpie = (value >> 7) & 0x1;
+    fields.ube = (value >> 6) & 0x1;
+    fields.spie = (value >> 5) & 0x1;
+    fields.mie = (value >> 3) & 0x1;
+    fields.sie = (value >> 1) & 0x1;
+
+    // SD
+    fields.sd = (fields.fs == 0b11) || (fields.xs == 0b11);
+
+    // MXR, SUM, MPRV and MPP decide what cached translations may be used for
+    cpu.update_tlb_permissions();
+
+    return true;
+}
+
 bool SStatus::write(const u64 value, CPU& cpu)
 {
     // Don't set the wpri fields; keep them zero (XS is read-only)
@@ -134,6 +164,9 @@ bool SStatus::write(const u64 value, CPU& cpu)
     fields.sie = (value >> 1) & 0x1;
     fields.sd = (fields.fs == 0b11) || (fields.xs == 0b11);
 
+    // As for mstatus (MXR and SUM)
+    cpu.update_tlb_permissions();
+
     return true;
 }
 
@@ -183,15 +216,26 @@ std::optional<u64> MISA::read(CPU& cpu)
 
 bool SATP::write(const u64 value, CPU& cpu)
 {
-    u64 old_bits = bits;
+    const SATP old = *this;
     bits = value;
 
     // "if satp is written with an unsupported MODE, the entire write has no
     // effect; no fields in satp are modified"
     if (get_mode() != ModeSettings::None && get_mode() != ModeSettings::Sv39)
-        bits = old_bits;
-
-    cpu.invalidate_tlb();
+        bits = old.bits;
+
+    // Translations are tagged with their ASID, so switching address spaces
+    // needn't throw them away; only turning paging on or off, or giving the
+    // same ASID a different page table (which really wants an sfence.vma,
+    // but isn't always given one) does
+    if (get_mode() != old.get_mode() ||
+        (get_asid() == old.get_asid() && get_ppn() != old.get_ppn()))
+    {
+        cpu.invalidate_tlb();
+        cpu.invalidate_decoded_blocks();
+    }
+    else if (get_asid() != old.get_asid())
+        cpu.switch_address_space();
 
     return true;
 }
@@ -0,0 +1,620 @@
+#include "decoder.h"
+#include "opcodes_base.h"
+#include "opcodes_zicsr.h"
+#include "opcodes_m.h"
+#include "opcodes_a.h"
+#include "opcodes_f.h"
+#include "opcodes_c.h"
+
+// Helpers
+typedef void (*Handler)(CPU& cpu, const Instruction instruction);
+typedef void (*CompressedHandler)(CPU& cpu, const CompressedInstruction instruction);
+
+template<Handler F> static void execute(CPU& cpu, const u32 instruction);
+template<Handler F, bool is_write> static void execute_floating(CPU& cpu, const u32 instruction);
+template<CompressedHandler F> static void execute_compressed(CPU& cpu, const u32 instruction);
+static void unknown_instruction(CPU& cpu, const u32 instruction);
+static void unknown_compressed_instruction(CPU& cpu, const u32 instruction);
+
+/*
+    The tables are built at compile time from these, which go field by field
+    the same way the spec lays them out. Both are indexed by every bit they
+    look at, so the few instructions that also depend on rs2 (the system
+    instructions and FP conversions) get a handler that decodes the rest.
+*/
+static constexpr DecodedHandler decode(const u8 opcode, const u8 funct3, const u8 funct7);
+static constexpr DecodedHandler decode_compressed(const u16 instruction);
+
+static constexpr size_t get_table_index(const u8 opcode, const u8 funct3, const u8 funct7)
+{
+    // The bottom two bits of the opcode are always set
+    return ((size_t)(opcode >> 2) << 10) | ((size_t)funct3 << 7) | funct7;
+}
+
+static constexpr std::array<DecodedHandler, 32 * 8 * 128> make_table()
+{
+    std::array<DecodedHandler, 32 * 8 * 128> table = {};
+    for (u8 opcode = 0b11; opcode < 0x80; opcode += 0b100)
+        for (u8 funct3 = 0; funct3 < 8; ++funct3)
+            for (u8 funct7 = 0; funct7 < 0x80; ++funct7)
+                table[get_table_index(opcode, funct3, funct7)] = decode(opcode, funct3, funct7);
+    return table;
+}
+
+static constexpr std::array<DecodedHandler, 0x10000> make_compressed_table()
+{
+    std::array<DecodedHandler, 0x10000> table = {};
+    for (size_t instruction = 0; instruction < table.size(); ++instruction)
+        table[instruction] = decode_compressed((u16)instruction);
+    return table;
+}
+
+// -- Instructions needing more than opcode, funct3 and funct7 --
+
+static void system_instruction(CPU& cpu, const Instruction instruction)
+{
+    const u8 rs2 = instruction.get_rs2();
+    const u8 funct7 = instruction.get_funct7();
+
+    if (rs2 == ECALL && funct7 == 0)         ecall(cpu, instruction);
+    else if (rs2 == EBREAK && funct7 == 0)   ebreak(cpu, instruction);
+    else if (rs2 == URET && funct7 == 0)     uret(cpu, instruction);
+    else if (rs2 == 2 && funct7 == SRET)     sret(cpu, instruction);
+    else if (rs2 == 2 && funct7 == MRET)     mret(cpu, instruction);
+    else if (rs2 == 5 && funct7 == WFI)      wfi(cpu, instruction);
+    else if (funct7 == SFENCE_VMA)           sfence_vma(cpu, instruction);
+    else if (funct7 == HFENCE_BVMA)          throw std::runtime_error("hfence.bvma");
+    else if (funct7 == HFENCE_GVMA)          throw std::runtime_error("hfence.gvma");
+    else unknown_instruction(cpu, instruction.instruction);
+}
+
+// Conversions to and from integers pick the integer type with rs2
+template<Handler W, Handler WU, Handler L, Handler LU>
+static void convert(CPU& cpu, const Instruction instruction)
+{
+    switch (instruction.get_rs2())
+    {
+        case 0b00:  W (cpu, instruction); break;
+        case 0b01:  WU(cpu, instruction); break;
+        case 0b10:  L (cpu, instruction); break;
+        case 0b11:  LU(cpu, instruction); break;
+        default:    unknown_instruction(cpu, instruction.instruction);
+    }
+}
+
+static void nop(CPU& cpu, const Instruction instruction) {}
+static void c_nop(CPU& cpu, const CompressedInstruction instruction) {}
+
+// -- Decoding --
+
+static constexpr DecodedHandler decode(const u8 opcode, const u8 funct3, const u8 funct7)
+{
+    switch (opcode)
+    {
+        case OPCODES_BASE_R_TYPE:
+        {
+            // Distinguished from OPCODES_M by funct7
+            if (funct7 == OPCODES_M_FUNCT_7)
+            {
+                switch (funct3)
+                {
+                    case MUL:       return execute<mul>;
+                    case MULH:      return execute<mulh>;
+                    case MULHSU:    return execute<mulhsu>;
+                    case MULHU:     return execute<mulhu>;
+                    case DIV:       return execute<div>;
+                    case DIVU:      return execute<divu>;
+                    case REM:       return execute<rem>;
+                    case REMU:      return execute<remu>;
+                }
+                break;
+            }
+
+            switch (funct3)
+            {
+                case ADD:
+                {
+                    if (funct7 == 0)    return execute<add>;
+                    if (funct7 == SUB)  return execute<sub>;
+                    break;
+                }
+                case XOR:   return execute<_xor>;
+                case OR:    return execute<_or>;
+                case AND:   return execute<_and>;
+                case SLL:   return execute<sll>;
+
+                case OPCODES_SHIFT_RIGHT:
+                {
+                    if (funct7 == SRL)  return execute<srl>;
+                    if (funct7 == SRA)  return execute<sra>;
+                    break;
+                }
+
+                case SLT:   return execute<slt>;
+                case SLTU:  return execute<sltu>;
+            }
+            break;
+        }
+
+        case OPCODES_BASE_I_TYPE:
+        {
+            switch (funct3)
+            {
+                case ADDI:  return execute<addi>;
+                case XORI:  return execute<xori>;
+                case ORI:   return execute<ori>;
+                case ANDI:  return execute<andi>;
+                case SLLI:  return execute<slli>;
+
+                case OPCODES_SHIFT_RIGHT:
+                {
+                    if ((funct7 & 0b11111110) == SRAI)  return execute<srai>;
+                    if ((funct7 & 0b11111110) == 0)     return execute<srli>;
+                    break;
+                }
+
+                case SLTI:  return execute<slti>;
+                case SLTIU: return execute<sltiu>;
+            }
+            break;
+        }
+
+        case OPCODES_BASE_LOAD_TYPE:
+        {
+            switch (funct3)
+            {
+                case LB:    return execute<lb>;
+                case LH:    return execute<lh>;
+                case LW:    return execute<lw>;
+                case LBU:   return execute<lbu>;
+                case LHU:   return execute<lhu>;
+                case LWU:   return execute<lwu>;
+                case LD:    return execute<ld>;
+            }
+            break;
+        }
+
+        case OPCODES_BASE_S_TYPE:
+        {
+            switch (funct3)
+            {
+                case SB:    return execute<sb>;
+                case SH:    return execute<sh>;
+                case SW:    return execute<sw>;
+                case SD:    return execute<sd>;
+            }
+            break;
+        }
+
+        case OPCODES_BASE_B_TYPE:
+        {
+            switch (funct3)
+            {
+                case BEQ:   return execute<beq>;
+                case BNE:   return execute<bne>;
+                case BLT:   return execute<blt>;
+                case BGE:   return execute<bge>;
+                case BLTU:  return execute<bltu>;
+                case BGEU:  return execute<bgeu>;
+            }
+            break;
+        }
+
+        case JAL:   return execute<jal>;
+        case JALR:  return execute<jalr>;
+
+        case LUI:   return execute<lui>;
+        case AUIPC: return execute<auipc>;
+
+        case OPCODES_BASE_SYSTEM:
+        {
+            switch (funct3)
+            {
+                case 0:         return execute<system_instruction>;
+                case CSRRW:     return execute<csrrw>;
+                case CSRRS:     return execute<csrrs>;
+                case CSRRC:     return execute<csrrc>;
+                case CSRRWI:    return execute<csrrwi>;
+                case CSRRSI:    return execute<csrrsi>;
+                case CSRRCI:    return execute<csrrci>;
+            }
+            break;
+        }
+
+        case OPCODES_BASE_FENCE:
+        {
+            // No cores so ordinary fences are a no-op, but fence.i still
+            // matters to anything caching decoded instructions
+            if (funct3 == FENCE_I)
+                return execute<fence_i>;
+            return execute<nop>;
+        }
+
+        case OPCODES_BASE_I_TYPE_32:
+        {
+            switch (funct3)
+            {
+                case ADDIW: return execute<addiw>;
+                case SLLIW: return execute<slliw>;
+
+                case OPCODES_SHIFT_RIGHT:
+                {
+                    if (funct7 == SRLIW)    return execute<srliw>;
+                    if (funct7 == SRAIW)    return execute<sraiw>;
+                    break;
+                }
+            }
+            break;
+        }
+
+        case OPCODES_BASE_R_TYPE_32:
+        {
+            // Distinguished from OPCODES_M_32 by funct7
+            if (funct7 == OPCODES_M_FUNCT_7)
+            {
+                switch (funct3)
+                {
+                    case MULW:  return execute<mulw>;
+                    case DIVW:  return execute<divw>;
+                    case DIVUW: return execute<divuw>;
+                    case REMW:  return execute<remw>;
+                    case REMUW: return execute<remuw>;
+                }
+                break;
+            }
+
+            switch (funct3)
+            {
+                case ADDW:
+                {
+                    if (funct7 == ADDW) return execute<addw>;
+                    if (funct7 == SUBW) return execute<subw>;
+                    break;
+                }
+
+                case SLLW:  return execute<sllw>;
+
+                case OPCODES_SHIFT_RIGHT:
+                {
+                    if (funct7 == SRLW) return execute<srlw>;
+                    if (funct7 == SRAW) return execute<sraw>;
+                    break;
+                }
+            }
+            break;
+        }
+
+        case OPCODES_A:
+        {
+            if (funct3 == OPCODES_A_FUNCT_3)
+            {
+                switch (funct7 >> 2)
+                {
+                    case LR_W:      return execute<lr_w>;
+                    case SC_W:      return execute<sc_w>;
+                    case AMOSWAP_W: return execute<amoswap_w>;
+                    case AMOADD_W:  return execute<amoadd_w>;
+                    case AMOXOR_W:  return execute<amoxor_w>;
+                    case AMOAND_W:  return execute<amoand_w>;
+                    case AMOOR_W:   return execute<amoor_w>;
+                    case AMOMIN_W:  return execute<amomin_w>;
+                    case AMOMAX_W:  return execute<amomax_w>;
+                    case AMOMINU_W: return execute<amominu_w>;
+                    case AMOMAXU_W: return execute<amomaxu_w>;
+                }
+            }
+            else if (funct3 == OPCODES_A_64)
+            {
+                switch (funct7 >> 2)
+                {
+                    case LR_D:      return execute<lr_d>;
+                    case SC_D:      return execute<sc_d>;
+                    case AMOSWAP_D: return execute<amoswap_d>;
+                    case AMOADD_D:  return execute<amoadd_d>;
+                    case AMOXOR_D:  return execute<amoxor_d>;
+                    case AMOAND_D:  return execute<amoand_d>;
+                    case AMOOR_D:   return execute<amoor_d>;
+                    case AMOMIN_D:  return execute<amomin_d>;
+                    case AMOMAX_D:  return execute<amomax_d>;
+                    case AMOMINU_D: return execute<amominu_d>;
+                    case AMOMAXU_D: return execute<amomaxu_d>;
+                }
+            }
+            break;
+        }
+
+        case OPCODES_F_1:
+        {
+            if (funct3 == FLW)  return execute_floating<flw, true>;
+            if (funct3 == FLD)  return execute_floating<fld, true>;
+            break;
+        }
+
+        case OPCODES_F_2:
+        {
+            if (funct3 == FSW)  return execute_floating<fsw, false>;
+            if (funct3 == FSD)  return execute_floating<fsd, false>;
+            break;
+        }
+
+        // Fused multiply-adds go by the bottom bit of funct7 (see
+        // Instruction::get_funct2)
+        case OPCODES_F_3: return (funct7 & 0b1) == FMADD_D  ? execute_floating<fmadd_d, true>  : execute_floating<fmadd_s, true>;
+        case OPCODES_F_4: return (funct7 & 0b1) == FMSUB_D  ? execute_floating<fmsub_d, true>  : execute_floating<fmsub_s, true>;
+        case OPCODES_F_5: return (funct7 & 0b1) == FNMADD_D ? execute_floating<fnmadd_d, true> : execute_floating<fnmadd_s, true>;
+        case OPCODES_F_6: return (funct7 & 0b1) == FNMSUB_D ? execute_floating<fnmsub_d, true> : execute_floating<fnmsub_s, true>;
+
+        case OPCODES_F_7:
+        {
+            switch (funct7)
+            {
+                case FADD_S: return execute_floating<fadd_s, true>;
+                case FADD_D: return execute_floating<fadd_d, true>;
+                case FSUB_S: return execute_floating<fsub_s, true>;
+                case FSUB_D: return execute_floating<fsub_d, true>;
+                case FMUL_S: return execute_floating<fmul_s, true>;
+                case FMUL_D: return execute_floating<fmul_d, true>;
+                case FDIV_S: return execute_floating<fdiv_s, true>;
+                case FDIV_D: return execute_floating<fdiv_d, true>;
+
+                case 0x10:
+                {
+                    switch (funct3)
+                    {
+                        case FSGNJ_S:  return execute_floating<fsgnj_s, true>;
+                        case FSGNJN_S: return execute_floating<fsgnjn_s, true>;
+                        case FSGNJX_S: return execute_floating<fsgnjx_s, true>;
+                    }
+                    break;
+                }
+
+                case 0x11:
+                {
+                    switch (funct3)
+                    {
+                        case FSGNJ_D:  return execute_floating<fsgnj_d, true>;
+                        case FSGNJN_D: return execute_floating<fsgnjn_d, true>;
+                        case FSGNJX_D: return execute_floating<fsgnjx_d, true>;
+                    }
+                    break;
+                }
+
+                case 0x14:
+                {
+                    if (funct3 == FMIN_S) return execute_floating<fmin_s, true>;
+                    if (funct3 == FMAX_S) return execute_floating<fmax_s, true>;
+                    break;
+                }
+
+                case 0x15:
+                {
+                    if (funct3 == FMIN_D) return execute_floating<fmin_d, true>;
+                    if (funct3 == FMAX_D) return execute_floating<fmax_d, true>;
+                    break;
+                }
+
+                case 0x50:
+                {
+                    switch (funct3)
+                    {
+                        case FEQ_S: return execute_floating<feq_s, false>;
+                        case FLT_S: return execute_floating<flt_s, false>;
+                        case FLE_S: return execute_floating<fle_s, false>;
+                    }
+                    break;
+                }
+
+                case 0x51:
+                {
+                    switch (funct3)
+                    {
+                        case FEQ_D: return execute_floating<feq_d, false>;
+                        case FLT_D: return execute_floating<flt_d, false>;
+                        case FLE_D: return execute_floating<fle_d, false>;
+                    }
+                    break;
+                }
+
+                case 0x60: return execute_floating<convert<fcvt_w_s, fcvt_wu_s, fcvt_l_s, fcvt_lu_s>, false>;
+                case 0x61: return execute_floating<convert<fcvt_w_d, fcvt_wu_d, fcvt_l_d, fcvt_lu_d>, false>;
+                case 0x68: return execute_floating<convert<fcvt_s_w, fcvt_s_wu, fcvt_s_l, fcvt_s_lu>, true>;
+                case 0x69: return execute_floating<convert<fcvt_d_w, fcvt_d_wu, fcvt_d_l, fcvt_d_lu>, true>;
+
+                case 0x70:
+                {
+                    if (funct3 == FMV_X_W)  return execute_floating<fmv_x_w, false>;
+                    if (funct3 == FCLASS_S) return execute_floating<fclass_s, false>;
+                    break;
+                }
+
+                case 0x71:
+                {
+                    if (funct3 == FMV_X_D)  return execute_floating<fmv_x_d, false>;
+                    if (funct3 == FCLASS_D) return execute_floating<fclass_d, false>;
+                    break;
+                }
+
+                case FCVT_S_D: return execute_floating<fcvt_s_d, true>;
+                case FCVT_D_S: return execute_floating<fcvt_d_s, true>;
+                case FSQRT_S:  return execute_floating<fsqrt_s, true>;
+                case FSQRT_D:  return execute_floating<fsqrt_d, true>;
+                case FMV_W_X:  return execute_floating<fmv_w_x, true>;
+                case FMV_D_X:  return execute_floating<fmv_d_x, true>;
+            }
+            break;
+        }
+    }
+
+    return unknown_instruction;
+}
+
+static constexpr DecodedHandler decode_compressed(const u16 instruction)
+{
+    const u8 opcode = instruction & 0b11;
+    const u8 funct3 = (instruction >> 13) & 0b111;
+    const u8 rd = (instruction >> 7) & 0b11111;
+
+    switch (opcode)
+    {
+        case 0b00:
+        {
+            switch (funct3)
+            {
+                case C_LW:          return execute_compressed<c_lw>;
+                case C_LD:          return execute_compressed<c_ld>;
+                case C_SW:          return execute_compressed<c_sw>;
+                case C_SD:          return execute_compressed<c_sd>;
+                case C_ADDI4SPN:    return execute_compressed<c_addi4spn>;
+                case C_FLD:         return execute_compressed<c_fld>;
+                case C_FSD:         return execute_compressed<c_fsd>;
+            }
+            break;
+        }
+
+        case 0b01:
+        {
+            switch (funct3)
+            {
+                case C_LI:          return execute_compressed<c_li>;
+                case C_J:           return execute_compressed<c_j>;
+                case C_BEQZ:        return execute_compressed<c_beqz>;
+                case C_BNEZ:        return execute_compressed<c_bnez>;
+                case C_ADDI:        return execute_compressed<c_addi>;
+                case C_ADDIW:       return execute_compressed<c_addiw>;
+                case C_ADDI16SP:
+                {
+                    switch (rd)
+                    {
+                        case 0:     return execute_compressed<c_nop>;
+                        case 2:     return execute_compressed<c_addi16sp>;
+                        default:    return execute_compressed<c_lui>;
+                    }
+                }
+                case 0b100:
+                {
+                    switch ((instruction >> 10) & 0b11)
+                    {
+                        case C_SRLI: return execute_compressed<c_srli>;
+                        case C_SRAI: return execute_compressed<c_srai>;
+                        case C_ANDI: return execute_compressed<c_andi>;
+                        case 0b11:
+                        {
+                            const u8 a = (instruction >> 12) & 0b1;
+                            const u8 b = (instruction >> 5) & 0b11;
+
+                            if (a == 0 && b == 0) return execute_compressed<c_sub>;
+                            if (a == 0 && b == 1) return execute_compressed<c_xor>;
+                            if (a == 0 && b == 2) return execute_compressed<c_or>;
+                            if (a == 0 && b == 3) return execute_compressed<c_and>;
+                            if (a == 1 && b == 0) return execute_compressed<c_subw>;
+                            if (a == 1 && b == 1) return execute_compressed<c_addw>;
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+            break;
+        }
+
+        case 0b10:
+        {
+            switch (funct3)
+            {
+                case C_LWSP:  return execute_compressed<c_lwsp>;
+                case C_LDSP:  return execute_compressed<c_ldsp>;
+                case C_FLDSP: return execute_compressed<c_fldsp>;
+                case C_SLLI:  return execute_compressed<c_slli>;
+
+                case 0b100:
+                {
+                    const u8 a = (instruction >> 12) & 0b1;
+                    const u8 b = (instruction >> 2) & 0x1f;
+
+                    if (a == 0 && b == 0) return execute_compressed<c_jr>;
+                    if (a == 0)           return execute_compressed<c_mv>;
+                    if (b == 0)           return rd != 0 ? execute_compressed<c_jalr> : execute_compressed<c_ebreak>;
+                    return execute_compressed<c_add>;
+                }
+
+                case C_SWSP:  return execute_compressed<c_swsp>;
+                case C_SDSP:  return execute_compressed<c_sdsp>;
+                case C_FSDSP: return execute_compressed<c_fsdsp>;
+            }
+            break;
+        }
+    }
+
+    return unknown_compressed_instruction;
+}
+
+// -- Tables --
+
+static constexpr std::array<DecodedHandler, 32 * 8 * 128> table = make_table();
+static constexpr std::array<DecodedHandler, 0x10000> compressed_table = make_compressed_table();
+
+DecodedHandler decode_instruction(const u32 instruction)
+{
+    const Instruction decoded = instruction;
+    return table[get_table_index(decoded.get_opcode(), decoded.get_funct3(), decoded.get_funct7())];
+}
+
+DecodedHandler decode_compressed_instruction(const u16 instruction)
+{
+    return compressed_table[instruction];
+}
+
+// -- Handlers --
+
+template<Handler F>
+static void execute(CPU& cpu, const u32 instruction)
+{
+    F(cpu, instruction);
+    if (!cpu.pending_trap.has_value())
+        cpu.pc += sizeof(u32);
+}
+
+template<Handler F, bool is_write>
+static void execute_floating(CPU& cpu, const u32 instruction)
+{
+    // Anything touching the FP registers with them switched off raises an
+    // exception instead
+    if (check_fs_field(cpu, is_write))
+        F(cpu, instruction);
+    if (!cpu.pending_trap.has_value())
+        cpu.pc += sizeof(u32);
+}
+
+template<CompressedHandler F>
+static void execute_compressed(CPU& cpu, const u32 instruction)
+{
+    F(cpu, (u16)instruction);
+    if (!cpu.pending_trap.has_value())
+        cpu.pc += sizeof(u16);
+}
+
+static void unknown_instruction(CPU& cpu, const u32 instruction)
+{
+    const Instruction decoded = instruction;
+    throw std::runtime_error(std::format(
+        "unknown opcode 0x{:x} with funct3 0x{:x}, funct7 0x{:x}, rs2 0x{:x} - raw = 0x{:x}, pc = 0x{:x}",
+        decoded.get_opcode(),
+        decoded.get_funct3(),
+        decoded.get_funct7(),
+        decoded.get_rs2(),
+        instruction,
+        cpu.pc
+    ));
+}
+
+static void unknown_compressed_instruction(CPU& cpu, const u32 instruction)
+{
+    const CompressedInstruction decoded = (u16)instruction;
+    throw std::runtime_error(std::format(
+        "unknown opcode 0x{:x} with funct3 0x{:x} - raw = 0x{:x}, pc = 0x{:x}",
+        decoded.get_opcode(),
+        decoded.get_funct3(),
+        decoded.instruction,
+        cpu.pc
+    ));
+}
@@ -108,7 +108,7 @@ bool CLINT::write_byte(const u64 address, const u8 value)
     return false;
 }
 
-void CLINT::increment(CPU& cpu)
+void CLINT::increment(CPU& cpu, u64 ticks)
 {
     /*
         Increment the mtime register.
@@ -117,7 +117,7 @@ void CLINT::increment(CPU& cpu)
         Software interrupts instead manipulate the MSIP register.
      */
 
-    mtime += 1;
+    mtime += ticks;
 
     if ((msip & 1) != 0)
         cpu.mip.set_msi();
@@ -128,3 +128,8 @@ void CLINT::increment(CPU& cpu)
     if (mtime >= mtimecmp)
         cpu.mip.set_mti();
 }
+
+u64 CLINT::get_ticks_until_interrupt() const
+{
+    return mtime >= mtimecmp ? 0 : mtimecmp - mtime;
+}
@@ -250,7 +250,13 @@ u32 VirtioBlockDevice::process_queue_description_head(CPU& cpu, const QueueDescr
 
     if (header.type == BlockDeviceHeader::Type::Read &&
         descriptors[1].is_device_write_only())
+    {
+        // Might be reading code in over code the JIT's translated
+        for (u64 offset = 0; offset < length; offset += 4096)
+            cpu.bus.check_for_code_write(descriptors[1].address + offset, 1);
+        cpu.bus.check_for_code_write(descriptors[1].address + length - 1, 1);
         memcpy(data, image_buffer, length);
+    }
 
     else if (header.type == BlockDeviceHeader::Type::Write &&
         !descriptors[1].is_device_write_only())
@@ -1,4 +1,5 @@
 #include "jit/jit.h"
+#include "jit/jit_cache.h"
 #include "jit/jit_base.h"
 #include "jit/jit_zicsr.h"
 #include "jit/jit_a.h"
@@ -16,19 +17,61 @@ using namespace JIT;
 
 #define DEBUG_JIT false
 #define FRAME_LIMIT 256
+#define INSTRUCTION_BUDGET 1024
+#define TRACE_LIMIT 1024
 
 // Global CPU pointer for interface functions
 static CPU* interface_cpu = nullptr;
 
-// Cached previously translated code
-static std::vector<Frame> cached_frames = {};
+// Cached previously translated code, by physical page
+static std::unordered_map<u64, std::vector<Frame*>> cached_frames = {};
+static std::array<JumpCacheEntry, jump_cache_size> jump_cache = {};
 
-// Global LLVM
-llvm::LLVMContext context;
+// Compiled frames kept on disk, if enabled; must outlive the sessions
+static std::unique_ptr<CodeCache> baseline_cache = nullptr;
+static std::unique_ptr<CodeCache> optimising_cache = nullptr;
+
+// Global LLVM - each tier has its own JIT session (as code generation options
+// are per-session) but each frame's module gets its own resource tracker so
+// that it can be freed on its own
+static std::unique_ptr<llvm::orc::LLJIT> baseline_jit = nullptr;
+static std::unique_ptr<llvm::orc::LLJIT> optimising_jit = nullptr;
+static std::atomic<u64> frames_compiled = 0;
+static Options options = {};
 
 // Hack to fix PC return issues
 static bool csr_caused_tlb_flush = false;
 
+// For chaining; set by frames as they leave through an unlinked exit
+static u64* pending_chain_slot = nullptr;
+
+// For the code budget; bytes of generated code currently installed, and
+// which frames have been used least recently (see evict_cold_frames)
+static u64 code_bytes = 0;
+static u64 peak_code_bytes = 0;
+static u64 frames_evicted = 0;
+static u64 frame_clock = 0;
+
+// Size of the object most recently linked by this thread, as frames are
+// always compiled on the thread that looks them up (see compile_frame), and
+// of the code in it if anyone's asked (see write_perf_map_entry)
+static thread_local u64 last_object_size = 0;
+static thread_local u64 last_function_size = 0;
+
+// For profiling with perf; written by both compiler threads
+static std::ofstream perf_map;
+static std::mutex perf_map_mutex;
+
+// For background compilation; frames waiting on the baseline compiler, by
+// physical page, so that they're only queued the once
+static CompileQueue baseline_queue;
+static std::unordered_map<u64, std::vector<Frame*>> pending_frames = {};
+
+// For tiering; frames report themselves as hot while running, then get queued
+// for the optimiser once they've returned
+static CompileQueue optimiser_queue;
+static std::vector<Frame*> hot_frames = {};
+
 #if DEBUG_JIT
 llvm::Function* debug_trace;
 llvm::Function* debug_print;
@@ -36,117 +79,301 @@ bool on_debug_trace(Instruction instruction, u64 pc);
 void on_debug_print(u64 value);
 #endif
 
-void JIT::init()
+void JIT::init(CPU& cpu, const Options& new_options)
 {
+    options = new_options;
+
+    // Frames on written pages are thrown away in run_next_frame, which then
+    // empties Bus::written_code_pages
+    cpu.bus.is_jit_enabled = true;
+
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
+
+    const auto create_session = [&](llvm::CodeGenOptLevel level, CodeCache* cache)
+    {
+        llvm::Expected<llvm::orc::JITTargetMachineBuilder> target_machine_builder =
+            llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (!target_machine_builder)
+            throw std::runtime_error("failed to detect host: " + llvm::toString(target_machine_builder.takeError()));
+        target_machine_builder->setCodeGenOptLevel(level);
+
+        // Everything the CPU has is reached through the cpu symbol (see
+        // get_cpu_field), which could be anywhere relative to the code
+        target_machine_builder->setRelocationModel(llvm::Reloc::PIC_);
+
+        llvm::orc::LLJITBuilder builder;
+        builder.setJITTargetMachineBuilder(std::move(*target_machine_builder));
+        if (cache != nullptr)
+        {
+            builder.setCompileFunctionCreator([cache](llvm::orc::JITTargetMachineBuilder target_machine_builder)
+                -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>>
+            {
+                llvm::Expected<std::unique_ptr<llvm::TargetMachine>> target_machine =
+                    target_machine_builder.createTargetMachine();
+                if (!target_machine)
+                    return target_machine.takeError();
+
+                return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*target_machine), cache);
+            });
+        }
+
+        llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> session = builder.create();
+        if (!session)
+            throw std::runtime_error("failed to create llvm::orc::LLJIT: " + llvm::toString(session.takeError()));
+
+        (*session)->getObjTransformLayer().setTransform([](std::unique_ptr<llvm::MemoryBuffer> object)
+            -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>
+        {
+            last_object_size = object->getBufferSize();
+            if (options.write_perf_map)
+                last_function_size = get_function_size(*object);
+
+            return object;
+        });
+
+        // Interface functions only need to be resolved the once
+        link_interface_functions(**session, cpu);
+        return std::move(*session);
+    };
+
+    if (options.write_perf_map)
+    {
+        const std::string path = std::format("/tmp/perf-{}.map", getpid());
+        perf_map.open(path);
+        if (!perf_map)
+            throw std::runtime_error("failed to open " + path);
+    }
+
+    if (options.cache_directory.has_value())
+    {
+        baseline_cache = std::make_unique<CodeCache>(*options.cache_directory, "baseline");
+        if (options.hot_threshold != 0)
+            optimising_cache = std::make_unique<CodeCache>(*options.cache_directory, "optimised");
+    }
+
+    // Baseline frames are needed as soon as possible so speed is all that
+    // matters...
+    baseline_jit = create_session(llvm::CodeGenOptLevel::None, baseline_cache.get());
+    baseline_queue.session = baseline_jit.get();
+    baseline_queue.context = llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+    baseline_queue.count_executions = options.hot_threshold != 0;
+    baseline_queue.cache = baseline_cache.get();
+    if (options.background_compilation)
+        start_compiler(baseline_queue);
+
+    // ...but hot ones are worth the time to run the full pipeline over, unless
+    // it's already been run on a previous boot
+    if (options.hot_threshold != 0)
+    {
+        optimising_jit = create_session(llvm::CodeGenOptLevel::Default, optimising_cache.get());
+        optimising_jit->getIRTransformLayer().setTransform([](
+            llvm::orc::ThreadSafeModule module,
+            const llvm::orc::MaterializationResponsibility&
+        ) -> llvm::Expected<llvm::orc::ThreadSafeModule>
+        {
+            module.withModuleDo([](llvm::Module& module)
+            {
+                if (optimising_cache == nullptr || !optimising_cache->contains(module))
+                    optimise_module(module);
+            });
+            return module;
+        });
+
+        optimiser_queue.session = optimising_jit.get();
+        optimiser_queue.context = llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+        optimiser_queue.promote_registers = true;
+        optimiser_queue.tier = Frame::Tier::Optimised;
+        optimiser_queue.cache = optimising_cache.get();
+        start_compiler(optimiser_queue);
+    }
+
+    // Compiler threads have to be stopped before anything is destroyed
+    std::atexit(shut_down);
 }
 
-void JIT::run_next_frame(CPU& cpu)
+u64 JIT::run_next_frame(CPU& cpu)
 {
     const u64 starting_pc = cpu.pc;
 
-    // We cache in virtual address space so any changes to the TLB mean trouble
+    // Nothing's running natively right now so it's safe to swap code over
+    install_baseline_frames();
+    if (options.hot_threshold != 0)
+    {
+        install_optimised_frames();
+        queue_hot_frames(cpu);
+    }
+
+    // Frames are tagged by physical address so survive any changes to the
+    // TLB, but not changes to the code itself (which fence.i needn't wait
+    // for, as the bus tells us as soon as it sees them)
+    if (!cpu.bus.written_code_pages.empty()) [[unlikely]]
+        invalidate_written_frames(cpu);
+
+    if (cpu.instruction_cache_was_flushed) [[unlikely]]
+        cpu.instruction_cache_was_flushed = false;
+
+    // The jump cache is in virtual address space though
     if (cpu.tlb_was_flushed) [[unlikely]]
     {
-        for (auto& frame : cached_frames)
-            delete frame.engine;
-        cached_frames.clear();
+        jump_cache.fill({});
         cpu.tlb_was_flushed = false;
     }
 
+    if (options.code_budget != 0 && code_bytes > options.code_budget) [[unlikely]]
+        evict_cold_frames();
+
     // Check if code has already been translated
-    std::optional<Frame> frame = get_cached_frame(starting_pc);
-    if (frame.has_value())
+    Frame* frame = get_cached_frame(cpu, starting_pc);
+    if (frame != nullptr)
     {
+        frame->last_used = ++frame_clock;
         execute_frame(cpu, *frame, starting_pc);
+        return std::max<u64>(cpu.jit_instructions, 1);
     }
-    else
+
+    // If not, have it compiled in the background and interpret until it's
+    // ready (unless an exception occured when fetching it, in which case we
+    // must still raise it)
+    if (options.background_compilation)
     {
-        frame = compile_next_frame(cpu);
-        if (!frame.has_value())
+        if (!is_frame_pending(cpu, starting_pc))
+            queue_next_frame(cpu);
+
+        // Interpreted just as it would be without the JIT, and counted by
+        // the main loop like any frame
+        u64 instructions = 0;
+        if (!cpu.pending_trap.has_value())
         {
-            // Some sort of exception occured when fetching the instruction
-            // We will deal with it later but we must still raise it
-            check_for_exceptions(cpu);
-            return;
+            instructions = cpu.run_block();
+            cpu.update_tlb_permissions();
         }
 
-        execute_frame(cpu, *frame, starting_pc);
-        cache_frame(*frame);
+        check_for_exceptions(cpu);
+        return instructions;
+    }
+
+    frame = compile_next_frame(cpu);
+    if (frame == nullptr)
+    {
+        // Some sort of exception occured when fetching the instruction
+        // We will deal with it later but we must still raise it. If not,
+        // the instruction straddled two pages and is left to the interpreter.
+        u64 instructions = 0;
+        if (!cpu.pending_trap.has_value())
+        {
+            instructions = cpu.run_block();
+            cpu.update_tlb_permissions();
+        }
+
+        check_for_exceptions(cpu);
+        return instructions;
     }
+
+    cache_frame(frame);
+    execute_frame(cpu, *frame, starting_pc);
+    return std::max<u64>(cpu.jit_instructions, 1);
 }
 
-std::optional<Frame> JIT::compile_next_frame(CPU& cpu)
+Frame* JIT::compile_next_frame(CPU& cpu)
 {
-    // Create module
-    llvm::Module* module = new llvm::Module("jit", context);
-    llvm::IRBuilder builder(context);
+    const auto start_time = std::chrono::steady_clock::now();
 
-    // Register functions
-    Context jit_context(builder, context, cpu.pc);
-    jit_context.registers = get_registers(cpu, builder);
-    register_interface_functions(module, context, jit_context);
+    std::optional<std::vector<FrameInstruction>> instructions = fetch_frame(cpu);
+    if (!instructions.has_value())
+        return nullptr;
 
-    // Create entry
-    llvm::FunctionType* function_type = llvm::FunctionType::get(builder.getInt64Ty(), { builder.getInt64Ty() }, false);
-    llvm::Function* function = llvm::Function::Create(
-        function_type,
-        llvm::Function::ExternalLinkage,
-        "jit_main",
-        module
-    );
-    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", function);
-    builder.SetInsertPoint(entry);
+    // We've already fetched from it so translating can't fail
+    Frame* frame = new Frame(cpu.pc, *cpu.translate_instruction_address(cpu.pc));
+    const FrameCode code = compile_frame(cpu, baseline_queue, *instructions, frame);
 
-    // We will be called with an argument corresponding to the PC, and use a switch
-    // to jump to the correct label; populated later.
-    llvm::Value* pc_arg = function->getArg(0);
-#if DEBUG_JIT
-    builder.CreateCall(debug_print, { pc_arg });
-#endif
-    llvm::BasicBlock* default_block = llvm::BasicBlock::Create(context, "default", function);
-    llvm::SwitchInst* switch_instruction = builder.CreateSwitch(pc_arg, default_block, FRAME_LIMIT);
-    std::unordered_map<u64, llvm::BasicBlock*> label_map;
-    builder.SetInsertPoint(default_block);
+    frame->tracker = code.tracker;
+    frame->function = code.function;
+    frame->chain_slots = code.chain_slots;
+    frame->chain_slot_count = code.chain_slot_count;
+    frame->exit_counts = code.exit_counts;
+    frame->exit_targets = code.exit_targets;
+    frame->code_size = code.code_size;
+    frame->ending_pc = instructions->back().pc;
+
+    {
+        std::lock_guard<std::mutex> lock(baseline_queue.mutex);
+        baseline_queue.statistics.frames++;
+        baseline_queue.statistics.instructions += instructions->size();
+        baseline_queue.statistics.time += std::chrono::steady_clock::now() - start_time;
+    }
+
+    // Only needed should the frame ever be re-optimised
+    if (options.hot_threshold != 0)
+        frame->instructions = std::move(*instructions);
+
+    return frame;
+}
+
+void JIT::queue_next_frame(CPU& cpu)
+{
+    // The instructions have to be fetched here, as only we can touch the CPU
+    std::optional<std::vector<FrameInstruction>> instructions = fetch_frame(cpu);
+    if (!instructions.has_value())
+        return;
+
+    // The compiler might cut the frame short, but until it's done this stops
+    // anything in the middle of it being queued too
+    Frame* frame = new Frame(cpu.pc, *cpu.translate_instruction_address(cpu.pc));
+    frame->ending_pc = instructions->back().pc;
+    frame->is_being_compiled = true;
+    pending_frames[frame->get_physical_page()].push_back(frame);
+
+    {
+        std::lock_guard<std::mutex> lock(baseline_queue.mutex);
+        baseline_queue.jobs.push({ &cpu, frame, std::move(*instructions) });
+    }
+    baseline_queue.condition.notify_one();
+}
+
+std::optional<std::vector<FrameInstruction>> JIT::fetch_frame(CPU& cpu)
+{
+    std::vector<FrameInstruction> instructions;
+    const u64 starting_pc = cpu.pc;
+    u64 pc = cpu.pc;
 
-    // Fetch and emit instructions...
-    u64 starting_pc = cpu.pc;
-    u64 ending_pc;
-    bool frame_empty = true;
     for (int i = 0; i < FRAME_LIMIT; ++i)
     {
+        const bool frame_empty = instructions.empty();
+
+        // Frames may not leave the page they started in (see Frame)
+        if (pc / Frame::page_size != starting_pc / Frame::page_size)
+            break;
+
         // Check for 16-bit alignment
-        if ((cpu.pc & 0b1) != 0)
+        if ((pc & 0b1) != 0)
         {
-            cpu.raise_exception(Exception::InstructionAddressMisaligned, cpu.pc);
-            delete module;
+            cpu.raise_exception(Exception::InstructionAddressMisaligned, pc);
             return std::nullopt;
         }
 
         // Try to get a compressed instruction...
         const std::expected<CompressedInstruction, Exception> half_instruction =
-            cpu.read_16(cpu.pc, CPU::AccessType::Instruction);
+            cpu.read_16(pc, CPU::AccessType::Instruction);
         const bool is_compressed = (half_instruction.has_value() && (half_instruction->instruction & 0b11) != 0b11);
 
         // ...or a full 32-bit one
         std::expected<Instruction, Exception> instruction = std::unexpected(Exception::IllegalInstruction);
-        if (!is_compressed) instruction = cpu.read_32(cpu.pc, CPU::AccessType::Instruction);
+        if (!is_compressed) instruction = cpu.read_32(pc, CPU::AccessType::Instruction);
 
         // If we couldn't fetch anything, raise an exception
         if (!is_compressed && !instruction)
         {
             if (frame_empty)
             {
-                u64 faulty_address = cpu.pc;
-                if (!cpu.read_8(cpu.pc)) faulty_address = cpu.pc;
-                else if (!cpu.read_8(cpu.pc + 1)) faulty_address = cpu.pc + 1;
-                else if (!cpu.read_8(cpu.pc + 1)) faulty_address = cpu.pc + 2;
-                else faulty_address = cpu.pc + 3;
+                u64 faulty_address = pc;
+                if (!cpu.read_8(pc)) faulty_address = pc;
+                else if (!cpu.read_8(pc + 1)) faulty_address = pc + 1;
+                else if (!cpu.read_8(pc + 1)) faulty_address = pc + 2;
+                else faulty_address = pc + 3;
 
                 cpu.raise_exception(instruction.error(), faulty_address);
-                delete module;
                 return std::nullopt;
             }
             else break;
@@ -158,7 +385,6 @@ std::optional<Frame> JIT::compile_next_frame(CPU& cpu)
             if (frame_empty)
             {
                 cpu.raise_exception(Exception::IllegalInstruction, instruction->instruction);
-                delete module;
                 return std::nullopt;
             }
             else break;
@@ -168,21 +394,177 @@ std::optional<Frame> JIT::compile_next_frame(CPU& cpu)
             if (frame_empty)
             {
                 cpu.raise_exception(Exception::IllegalInstruction, half_instruction->instruction);
-                delete module;
                 return std::nullopt;
             }
             else break;
         }
 
-        if (is_compressed)
-            jit_context.current_compressed_instruction = *half_instruction;
+        // An instruction straddling two pages would tie the frame to both of
+        // them, so leave these (very rare) cases to the interpreter
+        if (!is_compressed && pc % Frame::page_size == Frame::page_size - 2)
+        {
+            if (frame_empty)
+                return std::nullopt;
+            else
+                break;
+        }
+
+        instructions.push_back({
+            pc,
+            is_compressed ? half_instruction->instruction : instruction->instruction,
+            is_compressed
+        });
+        pc += is_compressed ? 2 : 4;
+    }
+
+    // From now on, the bus lets us know if any of it changes
+    cpu.protect_code_page(*cpu.translate_instruction_address(starting_pc));
+    return instructions;
+}
+
+/*
+    Emits and compiles a frame from instructions that have already been
+    fetched, using the queue's session and context. This doesn't touch the CPU
+    (other than taking the address of its registers) so can be done from any
+    thread, as long as the context isn't in use by any other. The list is cut
+    short if an instruction can't be translated or ends the frame.
+*/
+FrameCode JIT::compile_frame(
+    CPU& cpu,
+    CompileQueue& queue,
+    std::vector<FrameInstruction>& instructions,
+    Frame* frame
+)
+{
+    llvm::orc::LLJIT& session = *queue.session;
+
+    // Create module - everything it defines is named frame* until it's done
+    // and can be given a proper name (see name_frame)
+    llvm::LLVMContext& context = *queue.context.getContext();
+    llvm::Module* module = new llvm::Module("frame", context);
+    llvm::IRBuilder builder(context);
+
+    // Register functions
+    const u64 starting_pc = instructions.front().pc;
+    Context jit_context(builder, context, starting_pc);
+    const auto get_field = [&](const void* field, llvm::Type* type)
+    {
+        return get_cpu_field(cpu, builder, module, field, type);
+    };
+    jit_context.registers = get_field(cpu.registers, builder.getInt64Ty());
+    jit_context.fast_load_tlb = get_field(cpu.fast_load_tlb.data(), builder.getInt64Ty());
+    jit_context.fast_store_tlb = get_field(cpu.fast_store_tlb.data(), builder.getInt64Ty());
+    jit_context.float_registers = get_field(cpu.double_registers, builder.getInt64Ty());
+    jit_context.fcsr = get_field(&cpu.fcsr.bits, builder.getInt32Ty());
+    jit_context.mstatus = get_field(&cpu.mstatus.fields, builder.getInt64Ty());
+    jit_context.reservation = get_field(&cpu.bus.reservation, builder.getInt64Ty());
+    jit_context.privilege_level = get_field(&cpu.privilege_level, builder.getInt32Ty());
+    jit_context.jit_budget = get_field(&cpu.jit_budget, builder.getInt64Ty());
+    jit_context.jit_instructions = get_field(&cpu.jit_instructions, builder.getInt64Ty());
+    for (const auto& [address, csr] : std::initializer_list<std::pair<u16, u64*>> {
+        { CSR_SSCRATCH, &cpu.sscratch.value },
+        { CSR_SEPC,     &cpu.sepc.address },
+        { CSR_SCAUSE,   &cpu.scause.value },
+        { CSR_STVAL,    &cpu.stval.value },
+        { CSR_MSCRATCH, &cpu.mscratch.value },
+        { CSR_MEPC,     &cpu.mepc.address },
+        { CSR_MCAUSE,   &cpu.mcause.value },
+        { CSR_MTVAL,    &cpu.mtval.value }
+    })
+    {
+        jit_context.csrs[address] = get_field(csr, builder.getInt64Ty());
+    }
+
+    // The count lives with the code, and the Frame it belongs to is only
+    // filled in once it's linked, as its address is different every run
+    if (queue.count_executions)
+    {
+        jit_context.executions = new llvm::GlobalVariable(
+            *module,
+            builder.getInt64Ty(),
+            false,
+            llvm::GlobalValue::InternalLinkage,
+            llvm::ConstantInt::get(builder.getInt64Ty(), 0),
+            "frame_executions"
+        );
+        jit_context.frame = new llvm::GlobalVariable(
+            *module,
+            builder.getInt64Ty(),
+            false,
+            llvm::GlobalValue::ExternalLinkage,
+            llvm::ConstantInt::get(builder.getInt64Ty(), 0),
+            "frame_frame"
+        );
+    }
+    register_interface_functions(module, context, jit_context);
+
+    // Create entry
+    llvm::FunctionType* function_type = llvm::FunctionType::get(builder.getInt64Ty(), { builder.getInt64Ty() }, false);
+    llvm::Function* function = llvm::Function::Create(
+        function_type,
+        llvm::Function::ExternalLinkage,
+        "frame",
+        module
+    );
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", function);
+    builder.SetInsertPoint(entry);
+
+    // Guest registers can be kept on the stack instead, where LLVM is free to
+    // promote them to host ones, so long as they're synced up whenever anyone
+    // else could see them
+    if (queue.promote_registers)
+    {
+        jit_context.guest_registers = jit_context.registers;
+        jit_context.registers = builder.CreateAlloca(llvm::ArrayType::get(builder.getInt64Ty(), 32));
+    }
+
+    // Likewise for how many instructions have run (see flush_instruction_count)
+    jit_context.instructions_run = builder.CreateAlloca(builder.getInt64Ty());
+    builder.CreateStore(builder.getInt64(0), jit_context.instructions_run);
+
+    if (queue.count_executions)
+        count_execution(jit_context);
+
+    // We will be called with an argument corresponding to the PC, and use a switch
+    // to jump to the correct label; populated later.
+    llvm::Value* pc_arg = function->getArg(0);
+#if DEBUG_JIT
+    builder.CreateCall(debug_print, { pc_arg });
+#endif
+    llvm::BasicBlock* default_block = llvm::BasicBlock::Create(context, "default", function);
+    llvm::SwitchInst* switch_instruction = builder.CreateSwitch(pc_arg, default_block, FRAME_LIMIT);
+    std::unordered_map<u64, llvm::BasicBlock*> label_map;
+    builder.SetInsertPoint(default_block);
+
+    // Emit instructions...
+    u64 next_pc = starting_pc;
+    size_t instructions_emitted = 0;
+    for (const FrameInstruction& instruction : instructions)
+    {
+        // Traces carry on from somewhere else entirely (see form_trace), so
+        // whatever came before leaves for wherever it would have gone next
+        if (instructions_emitted != 0 && instruction.pc != next_pc)
+        {
+            llvm::BasicBlock* block_exit = llvm::BasicBlock::Create(context, "", function);
+            builder.CreateBr(block_exit);
+            jit_context.static_exits.push_back({ block_exit, next_pc });
+            builder.SetInsertPoint(llvm::BasicBlock::Create(context, "", function));
+        }
+
+        jit_context.pc = instruction.pc;
+        if (instruction.is_compressed)
+            jit_context.current_compressed_instruction = CompressedInstruction((u16)instruction.instruction);
         else
-            jit_context.current_instruction = *instruction;
+            jit_context.current_instruction = Instruction(instruction.instruction);
 
         llvm::BasicBlock* pc_block = llvm::BasicBlock::Create(context, "", function);
         builder.CreateBr(pc_block);
         builder.SetInsertPoint(pc_block);
-        label_map[cpu.pc] = pc_block;
+        label_map[instruction.pc] = pc_block;
+        builder.CreateStore(
+            builder.CreateAdd(builder.CreateLoad(builder.getInt64Ty(), jit_context.instructions_run), builder.getInt64(1)),
+            jit_context.instructions_run
+        );
 
     #if DEBUG_JIT
         builder.CreateCall(debug_trace, {
@@ -191,31 +573,37 @@ std::optional<Frame> JIT::compile_next_frame(CPU& cpu)
         });
     #endif
 
-        if ((is_compressed && emit_compressed_instruction(cpu, jit_context)) ||
-            (!is_compressed && emit_instruction(cpu, jit_context)))
+        if ((instruction.is_compressed && !emit_compressed_instruction(cpu, jit_context)) ||
+            (!instruction.is_compressed && !emit_instruction(cpu, jit_context)))
         {
-            // Now we've got at least one valid instruction, any failure to fetch
-            // another might mean we just strayed too far into the future
-            frame_empty = false;
-        }
-        else
-        {
-            if (frame_empty)
+            // Anything after the first instruction might just be us straying
+            // too far into the future
+            if (instructions_emitted == 0)
                 throw std::runtime_error("JIT - unsupported opcode");
-            else
-                break;
+
+            label_map.erase(instruction.pc);
+            break;
         }
 
-        ending_pc = cpu.pc;
-        cpu.pc = jit_context.pc + (is_compressed ? 2 : 4);
-        jit_context.pc = cpu.pc;
+        instructions_emitted++;
+        next_pc = instruction.pc + (instruction.is_compressed ? 2 : 4);
 
+        // Nothing more can be done in this block, but a trace might have
+        // others still to come
         if (jit_context.abort_translation)
-            break;
+        {
+            if (&instruction == &instructions.back() || (&instruction)[1].pc == next_pc)
+                break;
+
+            jit_context.abort_translation = false;
+        }
     }
+    instructions.resize(instructions_emitted);
 
-    // Return from block
-    builder.CreateRet(llvm::ConstantInt::get(builder.getInt64Ty(), cpu.pc));
+    // Fall through to whatever comes next
+    llvm::BasicBlock* fall_through_block = llvm::BasicBlock::Create(context, "", function);
+    builder.CreateBr(fall_through_block);
+    jit_context.static_exits.push_back({ fall_through_block, next_pc });
 
     // Fill in the switch instruction
     for (const auto& label : label_map)
@@ -224,18 +612,11 @@ std::optional<Frame> JIT::compile_next_frame(CPU& cpu)
         switch_instruction->addCase(llvm::ConstantInt::get(builder.getInt64Ty(), label.first), label_block);
     }
 
-    // Build engine - TODO: fix tests that fail under optimisations so that they can occur??
-    std::string error;
-    llvm::ExecutionEngine* engine = llvm::EngineBuilder(std::unique_ptr<llvm::Module>(module))
-        .setErrorStr(&error)
-        .setOptLevel(llvm::CodeGenOptLevel::None)
-        .setEngineKind(llvm::EngineKind::JIT)
-        .create();
-
-    if (!engine)
-        throw std::runtime_error("failed to create llvm::ExecutionEngine: " + error);
-
-    link_interface_functions(engine, jit_context);
+    // Now every PC in the frame is known, decide where each exit goes
+    link_static_exits(jit_context, module, label_map, starting_pc);
+    sync_instruction_count(jit_context, function);
+    if (queue.promote_registers)
+        sync_promoted_registers(jit_context, function);
 
 #if DEBUG_JIT
     if (starting_pc == 0x80E77050)
@@ -245,20 +626,149 @@ std::optional<Frame> JIT::compile_next_frame(CPU& cpu)
     assert(!llvm::verifyFunction(*function, &llvm::errs()));
 #endif
 
-    // IR will be lazily compiled when we call getFunctionAddress but it's nicer
-    // to do it here so it makes more sense in the profiler
-    engine->finalizeObject();
+    // Hand over to ORC
+    const std::string function_name = name_frame(queue, module);
+    llvm::orc::ResourceTrackerSP tracker = session.getMainJITDylib().createResourceTracker();
+    llvm::Error error = session.addIRModule(
+        tracker,
+        llvm::orc::ThreadSafeModule(std::unique_ptr<llvm::Module>(module), queue.context)
+    );
+    if (error)
+        throw std::runtime_error("failed to add module: " + llvm::toString(std::move(error)));
+
+    // IR is lazily compiled when first looked up, which we might as well do
+    // here so it makes more sense in the profiler (and so that it's done on
+    // this thread, which last_object_size relies on)
+    const auto lookup = [&](const std::string& name)
+    {
+        auto symbol = session.lookup(name);
+        if (!symbol)
+            throw std::runtime_error("failed to look up " + name + ": " + llvm::toString(symbol.takeError()));
+        return *symbol;
+    };
+
+    FrameCode code = {
+        tracker,
+        lookup(function_name).toPtr<Frame::Function>(),
+        lookup(function_name + "_chain_slots").toPtr<u64*>(),
+        jit_context.static_exits.size()
+    };
+    code.code_size = last_object_size;
+
+    if (options.write_perf_map)
+        write_perf_map_entry(queue, code, instructions);
+
+    if (queue.count_executions)
+    {
+        *lookup(function_name + "_frame").toPtr<u64*>() = reinterpret_cast<u64>(frame);
+        code.exit_counts = lookup(function_name + "_exit_counts").toPtr<u64*>();
+        for (const Context::StaticExit& exit : jit_context.static_exits)
+            code.exit_targets.push_back(exit.target);
+    }
+
+    return code;
+}
+
+/*
+    perf picks up /tmp/perf-<pid>.map by itself, so samples in JIT'd code can
+    be put down to the guest code it came from. There's no telling which
+    guest symbols they are, so they're named after their PC range.
+*/
+void JIT::write_perf_map_entry(
+    const CompileQueue& queue,
+    const FrameCode& code,
+    const std::vector<FrameInstruction>& instructions
+)
+{
+    const auto [first, last] = std::ranges::minmax(instructions, {}, &FrameInstruction::pc);
+    const std::string entry = std::format(
+        "{:x} {:x} guest_{:x}-{:x} [{}]\n",
+        reinterpret_cast<u64>(code.function),
+        last_function_size,
+        first.pc,
+        last.pc,
+        queue.tier == Frame::Tier::Optimised ? "optimised" : "baseline"
+    );
+
+    std::lock_guard<std::mutex> lock(perf_map_mutex);
+    perf_map << entry << std::flush;
+}
+
+u64 JIT::get_function_size(const llvm::MemoryBuffer& object)
+{
+    llvm::Expected<std::unique_ptr<llvm::object::ObjectFile>> file =
+        llvm::object::ObjectFile::createObjectFile(object.getMemBufferRef());
+    if (!file)
+    {
+        llvm::consumeError(file.takeError());
+        return 0;
+    }
+
+    const auto* elf = llvm::dyn_cast<llvm::object::ELFObjectFileBase>(file->get());
+    if (elf == nullptr)
+        return 0;
+
+    u64 size = 0;
+    for (const llvm::object::ELFSymbolRef& symbol : elf->symbols())
+    {
+        llvm::Expected<llvm::object::SymbolRef::Type> type = symbol.getType();
+        if (type && *type == llvm::object::SymbolRef::ST_Function)
+            size += symbol.getSize();
+        else if (!type)
+            llvm::consumeError(type.takeError());
+    }
+
+    return size;
+}
+
+/*
+    Names only have to be unique within the session, but a cached frame has
+    to be named the same from one run to the next so that its object can be
+    found again - after the IR it was compiled from, which covers the guest
+    code and every option that went into translating it. Identical frames
+    (the same code mapped at the same address more than once) are told apart
+    by how many have come before. Whatever's defined is renamed to match.
+*/
+std::string JIT::name_frame(CompileQueue& queue, llvm::Module* module)
+{
+    std::string name = std::format("frame_{}", frames_compiled++);
+    if (queue.cache != nullptr)
+    {
+        std::string ir;
+        llvm::raw_string_ostream stream(ir);
+        module->print(stream, nullptr);
 
-    return Frame(engine, starting_pc, ending_pc);
+        const u64 hash = llvm::xxh3_64bits(llvm::arrayRefFromStringRef(stream.str()));
+        name = std::format("frame_{:016x}_{}", hash, queue.frames_by_hash[hash]++);
+    }
+
+    for (llvm::GlobalValue& value : module->global_values())
+    {
+        if (!value.isDeclaration())
+            value.setName(name + value.getName().substr(std::strlen("frame")).str());
+    }
+
+    module->setModuleIdentifier(name);
+    return name;
 }
 
 void JIT::execute_frame(CPU& cpu, Frame& frame, u64 pc)
 {
     // Run
     interface_cpu = &cpu;
-    auto run = (u64(*)(u64))frame.engine->getFunctionAddress("jit_main");
-    u64 next_pc = run(pc);
-    cpu.pc = next_pc;
+    pending_chain_slot = nullptr;
+    cpu.jit_instructions = 0;
+    cpu.jit_budget = INSTRUCTION_BUDGET;
+
+    // Leave in time for the timer, unless it's already gone off (in which
+    // case waiting for it would only mean leaving every time round a loop)
+    const u64 cycles_until_timer = cpu.bus.get_cycles_until_timer();
+    if (cycles_until_timer != 0 && cycles_until_timer < INSTRUCTION_BUDGET)
+        cpu.jit_budget = cycles_until_timer;
+
+    discard_fp_exceptions();
+    cpu.pc = frame.function(pc);
+    collect_fp_exceptions(cpu);
 
     if (!check_for_exceptions(cpu))
         return;
@@ -269,43 +779,782 @@ void JIT::execute_frame(CPU& cpu, Frame& frame, u64 pc)
         csr_caused_tlb_flush = false;
     }
 
-    if (cpu.tlb_was_flushed)
+    if (cpu.tlb_was_flushed || cpu.instruction_cache_was_flushed)
         return;
 
-    // If the next PC is inside the already JIT'ed block, we can instead just jump back
-    while(next_pc >= frame.starting_pc && next_pc <= frame.ending_pc)
+    // Whichever frame we ended up in left through an exit that could have
+    // been chained, so do so now if its target has been compiled
+    if (pending_chain_slot != nullptr)
+        chain_frames(cpu, pending_chain_slot, cpu.pc);
+}
+
+/*
+    JIT'd floating point leaves its exceptions raised on the host FPU, to be
+    copied into fcsr once the frame returns instead of after every
+    instruction. Anything raised beforehand (by the interpreter, which already
+    dealt with them, or by us) mustn't be mistaken for the guest's.
+*/
+void JIT::discard_fp_exceptions()
+{
+    if (std::fetestexcept(FE_ALL_EXCEPT) != 0) [[unlikely]]
+        std::feclearexcept(FE_ALL_EXCEPT);
+}
+
+void JIT::collect_fp_exceptions(CPU& cpu)
+{
+    if (std::fetestexcept(FE_ALL_EXCEPT) == 0) [[likely]]
+        return;
+
+    update_fcsr_flags(cpu);
+    std::feclearexcept(FE_ALL_EXCEPT);
+}
+
+void JIT::cache_frame(Frame* frame)
+{
+    cached_frames[frame->get_physical_page()].push_back(frame);
+    frame->last_used = ++frame_clock;
+    code_bytes += frame->code_size;
+    peak_code_bytes = std::max(peak_code_bytes, code_bytes);
+}
+
+/*
+    Once the generated code outgrows its budget, the frames that have gone
+    longest without being run are thrown away, down to three quarters of the
+    budget so that it isn't straight back over. Frames only ever reached
+    through chains look colder than they are, but can always be compiled
+    again. Only called between frames, when nothing native is running.
+*/
+void JIT::evict_cold_frames()
+{
+    std::vector<Frame*> frames;
+    for (const auto& page : cached_frames)
+        frames.insert(frames.end(), page.second.begin(), page.second.end());
+    std::ranges::sort(frames, {}, &Frame::last_used);
+
+    std::unordered_set<Frame*> evicted;
+    const u64 target_bytes = options.code_budget / 4 * 3;
+    u64 remaining_bytes = code_bytes;
+    for (Frame* frame : frames)
     {
-        next_pc = run(next_pc);
-        cpu.pc = next_pc;
+        if (remaining_bytes <= target_bytes)
+            break;
 
-        if (!check_for_exceptions(cpu))
-            return;
+        remaining_bytes -= frame->code_size;
+        evicted.insert(frame);
+    }
+
+    for (JumpCacheEntry& entry : jump_cache)
+        if (evicted.contains(entry.frame))
+            entry = {};
+
+    for (Frame* frame : evicted)
+    {
+        const u64 page = frame->get_physical_page();
+        std::erase(cached_frames[page], frame);
+        if (cached_frames[page].empty())
+            cached_frames.erase(page);
+
+        free_frame(frame);
+    }
+    frames_evicted += evicted.size();
+}
+
+Frame* JIT::get_cached_frame(CPU& cpu, u64 pc)
+{
+    JumpCacheEntry& entry = jump_cache[(pc >> 1) % jump_cache_size];
+    if (entry.frame != nullptr && entry.pc == pc && entry.asid == cpu.satp.get_asid() &&
+        entry.privilege_level == cpu.privilege_level) [[likely]]
+        return entry.frame;
+
+    // If the PC can't be translated then compiling the frame will raise the
+    // appropriate exception
+    const std::expected<u64, Exception> physical_pc = cpu.translate_instruction_address(pc);
+    if (!physical_pc.has_value())
+        return nullptr;
+
+    const auto page = cached_frames.find(*physical_pc / Frame::page_size);
+    if (page == cached_frames.end())
+        return nullptr;
+
+    Frame* frame = find_frame(page->second, pc, *physical_pc);
+    if (frame != nullptr)
+        entry = { pc, cpu.satp.get_asid(), cpu.privilege_level, frame };
+
+    return frame;
+}
 
-        if (csr_caused_tlb_flush)
+bool JIT::is_frame_pending(CPU& cpu, u64 pc)
+{
+    const std::expected<u64, Exception> physical_pc = cpu.translate_instruction_address(pc);
+    if (!physical_pc.has_value())
+        return false;
+
+    const auto page = pending_frames.find(*physical_pc / Frame::page_size);
+    return page != pending_frames.end() && find_frame(page->second, pc, *physical_pc) != nullptr;
+}
+
+Frame* JIT::find_frame(const std::vector<Frame*>& frames, u64 pc, u64 physical_pc)
+{
+    for (Frame* frame : frames)
+    {
+        if (pc >= frame->starting_pc && pc <= frame->ending_pc &&
+            physical_pc - frame->physical_pc == pc - frame->starting_pc)
+            return frame;
+    }
+
+    return nullptr;
+}
+
+/*
+    Throws away every frame on a page that's been written to since it was
+    translated. Frames (and their chains) never leave their page, so nothing
+    elsewhere is affected.
+*/
+void JIT::invalidate_written_frames(CPU& cpu)
+{
+    // The interpreter might not have run since they were written
+    cpu.invalidate_written_blocks();
+
+    std::unordered_set<Frame*> invalidated;
+    for (const u64 page : std::exchange(cpu.bus.written_code_pages, {}))
+    {
+        if (const auto frames = cached_frames.find(page); frames != cached_frames.end())
+        {
+            invalidated.insert(frames->second.begin(), frames->second.end());
+            cached_frames.erase(frames);
+        }
+
+        // Anything still being compiled was fetched from the old code too
+        if (const auto frames = pending_frames.find(page); frames != pending_frames.end())
+        {
+            for (Frame* frame : frames->second)
+                frame->is_invalidated = true;
+            pending_frames.erase(frames);
+        }
+    }
+
+    for (JumpCacheEntry& entry : jump_cache)
+        if (invalidated.contains(entry.frame))
+            entry = {};
+
+    for (Frame* frame : invalidated)
+        free_frame(frame);
+}
+
+void JIT::free_frame(Frame* frame)
+{
+    code_bytes -= frame->code_size;
+    unchain_frame(frame);
+    llvm::cantFail(frame->tracker->remove());
+    std::erase(hot_frames, frame);
+
+    // The compiler will still hand it back once it's done, so leave it to be
+    // cleaned up then
+    if (frame->is_being_compiled)
+        frame->is_invalidated = true;
+    else
+        delete frame;
+}
+
+void JIT::link_static_exits(
+    Context& context,
+    llvm::Module* module,
+    const std::unordered_map<u64, llvm::BasicBlock*>& label_map,
+    u64 starting_pc
+)
+{
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Type* i64 = builder.getInt64Ty();
+    llvm::Function* function = builder.GetInsertBlock()->getParent();
+
+    // One slot per exit, filled in by chain_frames
+    llvm::ArrayType* slots_type = llvm::ArrayType::get(i64, std::max<size_t>(context.static_exits.size(), 1));
+    llvm::GlobalVariable* chain_slots = new llvm::GlobalVariable(
+        *module,
+        slots_type,
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        llvm::ConstantAggregateZero::get(slots_type),
+        "frame_chain_slots"
+    );
+
+    // For tracing; how often each exit that could be chained is taken
+    llvm::GlobalVariable* exit_counts = nullptr;
+    if (context.executions != nullptr)
+    {
+        exit_counts = new llvm::GlobalVariable(
+            *module,
+            slots_type,
+            false,
+            llvm::GlobalValue::ExternalLinkage,
+            llvm::ConstantAggregateZero::get(slots_type),
+            "frame_exit_counts"
+        );
+    }
+
+    // See link_interface_functions
+    llvm::Value* pending_slot = module->getOrInsertGlobal("pending_chain_slot", i64);
+
+    for (size_t i = 0; i < context.static_exits.size(); ++i)
+    {
+        const Context::StaticExit& exit = context.static_exits[i];
+        llvm::Value* target = llvm::ConstantInt::get(i64, exit.target);
+        builder.SetInsertPoint(exit.block);
+
+        // Anything leaving the page might be mapped differently next time,
+        // and anything that isn't has to go back to the main loop eventually
+        // so that devices and interrupts get a look in
+        const auto label = label_map.find(exit.target);
+        const bool same_page = exit.target / Frame::page_size == starting_pc / Frame::page_size;
+        if (label == label_map.end() && !same_page)
+        {
+            builder.CreateRet(target);
+            continue;
+        }
+
+        if (label == label_map.end() && exit_counts != nullptr)
+        {
+            llvm::Value* count = builder.CreateConstInBoundsGEP2_64(slots_type, exit_counts, 0, i);
+            builder.CreateStore(builder.CreateAdd(builder.CreateLoad(i64, count), llvm::ConstantInt::get(i64, 1)), count);
+        }
+
+        // Loops and chains only carry on while there's budget left (see
+        // CPU::jit_budget), so that interrupts get taken in good time
+        llvm::BasicBlock* stay_block = llvm::BasicBlock::Create(context.context, "", function);
+        llvm::BasicBlock* leave_block = llvm::BasicBlock::Create(context.context, "", function);
+        llvm::Value* remaining = flush_instruction_count(context);
+        builder.CreateCondBr(
+            builder.CreateICmpSGT(remaining, llvm::ConstantInt::get(i64, 0)),
+            stay_block,
+            leave_block
+        );
+
+        builder.SetInsertPoint(leave_block);
+        builder.CreateRet(target);
+        builder.SetInsertPoint(stay_block);
+
+        // Within this frame, so just branch - loops never go through the
+        // entry block so have to be counted here
+        if (label != label_map.end())
+        {
+            if (context.executions != nullptr)
+                count_execution(context);
+
+            builder.CreateBr(label->second);
+            continue;
+        }
+
+        // Otherwise call whatever the slot points to, or if it's empty, leave
+        // and say where we left from
+        llvm::Value* slot = builder.CreateConstInBoundsGEP2_64(slots_type, chain_slots, 0, i);
+        llvm::Value* slot_value = builder.CreateLoad(i64, slot);
+        llvm::BasicBlock* linked_block = llvm::BasicBlock::Create(context.context, "", function);
+        llvm::BasicBlock* unlinked_block = llvm::BasicBlock::Create(context.context, "", function);
+        builder.CreateCondBr(
+            builder.CreateICmpNE(slot_value, llvm::ConstantInt::get(i64, 0)),
+            linked_block,
+            unlinked_block
+        );
+
+        builder.SetInsertPoint(linked_block);
+        llvm::FunctionType* function_type = function->getFunctionType();
+        llvm::CallInst* call = builder.CreateCall(
+            function_type,
+            builder.CreateIntToPtr(slot_value, function_type->getPointerTo()),
+            { target }
+        );
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+        builder.CreateRet(call);
+
+        builder.SetInsertPoint(unlinked_block);
+        builder.CreateStore(builder.CreatePtrToInt(slot, i64), pending_slot);
+        builder.CreateRet(target);
+    }
+}
+
+void JIT::count_execution(Context& context)
+{
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Type* i64 = builder.getInt64Ty();
+    llvm::Function* function = builder.GetInsertBlock()->getParent();
+
+    llvm::Value* executions = context.executions;
+    llvm::Value* count = builder.CreateAdd(builder.CreateLoad(i64, executions), llvm::ConstantInt::get(i64, 1));
+    builder.CreateStore(count, executions);
+
+    // Only report it the once, exactly as it crosses the threshold
+    llvm::BasicBlock* hot_block = llvm::BasicBlock::Create(context.context, "", function);
+    llvm::BasicBlock* continue_block = llvm::BasicBlock::Create(context.context, "", function);
+    builder.CreateCondBr(
+        builder.CreateICmpEQ(count, llvm::ConstantInt::get(i64, options.hot_threshold)),
+        hot_block,
+        continue_block
+    );
+
+    builder.SetInsertPoint(hot_block);
+    builder.CreateCall(context.on_hot_frame, { builder.CreateLoad(i64, context.frame) });
+    builder.CreateBr(continue_block);
+    builder.SetInsertPoint(continue_block);
+}
+
+/*
+    Instructions are counted on the stack as they run, where LLVM can fold
+    them into one add per block, and only added to the CPU's count (and taken
+    off the budget) when the frame could leave: at each static exit that
+    might stay in native code, and before anything that returns or chains.
+*/
+llvm::Value* JIT::flush_instruction_count(Context& context)
+{
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Type* i64 = builder.getInt64Ty();
+
+    llvm::Value* count = builder.CreateLoad(i64, context.instructions_run);
+    builder.CreateStore(builder.getInt64(0), context.instructions_run);
+    builder.CreateStore(
+        builder.CreateAdd(builder.CreateLoad(i64, context.jit_instructions), count),
+        context.jit_instructions
+    );
+
+    llvm::Value* remaining = builder.CreateSub(builder.CreateLoad(i64, context.jit_budget), count);
+    builder.CreateStore(remaining, context.jit_budget);
+    return remaining;
+}
+
+void JIT::sync_instruction_count(Context& context, llvm::Function* function)
+{
+    std::vector<llvm::ReturnInst*> returns;
+    for (llvm::BasicBlock& block : *function)
+        for (llvm::Instruction& instruction : block)
+            if (auto* ret = llvm::dyn_cast<llvm::ReturnInst>(&instruction))
+                returns.push_back(ret);
+
+    // Nothing's allowed between a musttail call and its return
+    for (llvm::ReturnInst* ret : returns)
+    {
+        llvm::Instruction* previous = ret->getPrevNode();
+        if (auto* call = llvm::dyn_cast_or_null<llvm::CallInst>(previous); call && call->isMustTailCall())
+            context.builder.SetInsertPoint(call);
+        else
+            context.builder.SetInsertPoint(ret);
+
+        flush_instruction_count(context);
+    }
+}
+
+/*
+    Once the frame's been emitted, promoted registers are loaded in on entry
+    and written back before anything that leaves the frame or calls something
+    that could look at them, then loaded again afterwards in case they were
+    changed. Only registers the frame actually writes are ever written back.
+*/
+void JIT::sync_promoted_registers(Context& context, llvm::Function* function)
+{
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Type* i64 = builder.getInt64Ty();
+    const std::bitset<32> used_registers = context.read_registers | context.written_registers;
+
+    const auto copy = [&](llvm::Value* from, llvm::Value* to, const std::bitset<32>& registers)
+    {
+        for (u32 i = 1; i < 32; ++i)
+        {
+            if (!registers[i])
+                continue;
+
+            llvm::Value* value = builder.CreateLoad(i64, builder.CreateConstInBoundsGEP1_64(i64, from, i));
+            builder.CreateStore(value, builder.CreateConstInBoundsGEP1_64(i64, to, i));
+        }
+    };
+    const auto load = [&]() { copy(context.guest_registers, context.registers, used_registers); };
+    const auto write_back = [&]() { copy(context.registers, context.guest_registers, context.written_registers); };
+
+    // Find everywhere first, as syncing adds instructions of its own
+    std::vector<llvm::ReturnInst*> returns;
+    std::vector<llvm::CallInst*> calls;
+    for (llvm::BasicBlock& block : *function)
+    {
+        for (llvm::Instruction& instruction : block)
         {
-            cpu.pc += 4;
-            csr_caused_tlb_flush = false;
+            if (auto* ret = llvm::dyn_cast<llvm::ReturnInst>(&instruction))
+                returns.push_back(ret);
+            else if (auto* call = llvm::dyn_cast<llvm::CallInst>(&instruction))
+                if (may_access_registers(context, call))
+                    calls.push_back(call);
         }
+    }
+
+    // Chained frames load registers themselves so only need them written
+    // back, but nothing's allowed between a musttail call and its return
+    for (llvm::CallInst* call : calls)
+    {
+        builder.SetInsertPoint(call);
+        write_back();
+        if (call->isMustTailCall())
+            continue;
+
+        builder.SetInsertPoint(call->getNextNode());
+        load();
+    }
+
+    for (llvm::ReturnInst* ret : returns)
+    {
+        llvm::Instruction* previous = ret->getPrevNode();
+        if (auto* call = llvm::dyn_cast_or_null<llvm::CallInst>(previous); call && call->isMustTailCall())
+            continue;
+
+        builder.SetInsertPoint(ret);
+        write_back();
+    }
+
+    // Allocas have to stay at the start of the entry block
+    llvm::BasicBlock& entry = function->getEntryBlock();
+    llvm::BasicBlock::iterator position = entry.begin();
+    while (llvm::isa<llvm::AllocaInst>(*position))
+        ++position;
+
+    builder.SetInsertPoint(&entry, position);
+    load();
+}
+
+bool JIT::may_access_registers(Context& context, llvm::CallInst* call)
+{
+    // Anything unknown (i.e. a chained frame) could use any of them
+    llvm::Function* callee = call->getCalledFunction();
+    if (callee == nullptr)
+        return true;
+
+    if (callee->isIntrinsic())
+        return false;
+
+    // Loads and stores only raise exceptions, which are handled later on
+    const std::array<llvm::Function*, 10> safe_functions = {
+        context.on_lb, context.on_lh, context.on_lw, context.on_ld,
+        context.on_sb, context.on_sh, context.on_sw, context.on_sd,
+        context.set_fcsr_dz, context.on_hot_frame
+    };
+    return std::find(safe_functions.begin(), safe_functions.end(), callee) == safe_functions.end();
+}
+
+void JIT::chain_frames(CPU& cpu, u64* slot, u64 target)
+{
+    Frame* target_frame = get_cached_frame(cpu, target);
+    if (target_frame == nullptr)
+        return;
 
-        if (cpu.tlb_was_flushed)
+    // Exits are only chained within a page so the frame the slot belongs to
+    // must be in the same one
+    for (Frame* frame : cached_frames[target_frame->get_physical_page()])
+    {
+        if (slot >= frame->chain_slots && slot < frame->chain_slots + frame->chain_slot_count)
+        {
+            *slot = reinterpret_cast<u64>(target_frame->function);
+            target_frame->last_used = ++frame_clock;
+            frame->outgoing_chains.emplace_back(target_frame, slot);
+            target_frame->incoming_chains.emplace_back(frame, slot);
             return;
+        }
     }
 }
 
-void JIT::cache_frame(Frame& frame)
+void JIT::unchain_frame(Frame* frame)
 {
-    cached_frames.emplace_back(frame);
+    const auto incoming_chains = std::exchange(frame->incoming_chains, {});
+    const auto outgoing_chains = std::exchange(frame->outgoing_chains, {});
+    const auto is_frame = [&](const std::pair<Frame*, u64*>& chain) { return chain.first == frame; };
+
+    for (const auto& [source, slot] : incoming_chains)
+    {
+        *slot = 0;
+        std::erase_if(source->outgoing_chains, is_frame);
+    }
+
+    for (const auto& [target, slot] : outgoing_chains)
+        std::erase_if(target->incoming_chains, is_frame);
 }
 
-std::optional<Frame> JIT::get_cached_frame(u64 pc)
+void JIT::queue_hot_frames(CPU& cpu)
 {
-    for (const auto& frame : cached_frames)
+    if (hot_frames.empty())
+        return;
+
     {
-        if (pc >= frame.starting_pc && pc <= frame.ending_pc)
-            return frame;
+        std::lock_guard<std::mutex> lock(optimiser_queue.mutex);
+        for (Frame* frame : hot_frames)
+        {
+            frame->is_being_compiled = true;
+            optimiser_queue.jobs.push({ &cpu, frame, form_trace(frame) });
+        }
+    }
+
+    hot_frames.clear();
+    optimiser_queue.condition.notify_one();
+}
+
+/*
+    Hot frames are optimised together with wherever they most often go next,
+    as long as it's in the same page (as with any frame) and still has the
+    instructions it was built from. Each block of the trace is a run of some
+    frame's instructions from where it was branched to, and exits between
+    them become plain branches once compiled, so LLVM sees loops and calls
+    spanning several frames as the one function. An exit is hot once it's
+    been taken a quarter as often as it takes a frame to become hot.
+*/
+std::vector<FrameInstruction> JIT::form_trace(Frame* frame)
+{
+    std::vector<FrameInstruction> trace = frame->instructions;
+    std::unordered_set<u64> traced_pcs;
+    for (const FrameInstruction& instruction : trace)
+        traced_pcs.insert(instruction.pc);
+
+    const auto page = cached_frames.find(frame->get_physical_page());
+    if (page == cached_frames.end())
+        return trace;
+
+    const u64 hot_count = std::max<u64>(options.hot_threshold / 4, 1);
+    std::vector<Frame*> members = { frame };
+    for (size_t i = 0; i < members.size() && trace.size() < TRACE_LIMIT; ++i)
+    {
+        const Frame* member = members[i];
+        if (member->exit_counts == nullptr)
+            continue;
+
+        for (size_t exit = 0; exit < member->exit_targets.size(); ++exit)
+        {
+            const u64 target = member->exit_targets[exit];
+            if (member->exit_counts[exit] < hot_count || traced_pcs.contains(target) ||
+                target / Frame::page_size != frame->starting_pc / Frame::page_size)
+                continue;
+
+            Frame* target_frame = find_frame(page->second, target, frame->physical_pc + (target - frame->starting_pc));
+            if (target_frame == nullptr)
+                continue;
+
+            const auto start = std::find_if(
+                target_frame->instructions.begin(),
+                target_frame->instructions.end(),
+                [&](const FrameInstruction& instruction) { return instruction.pc == target; }
+            );
+
+            // Up to the end of the frame, or wherever it runs into the trace
+            for (auto instruction = start; instruction != target_frame->instructions.end(); ++instruction)
+            {
+                if (traced_pcs.contains(instruction->pc) || trace.size() == TRACE_LIMIT)
+                    break;
+
+                trace.push_back(*instruction);
+                traced_pcs.insert(instruction->pc);
+            }
+
+            if (start != target_frame->instructions.end() && std::ranges::find(members, target_frame) == members.end())
+                members.push_back(target_frame);
+        }
+    }
+
+    return trace;
+}
+
+void JIT::install_baseline_frames()
+{
+    for (auto& [frame, code, instructions] : take_compiled_frames(baseline_queue))
+    {
+        if (frame->is_invalidated)
+        {
+            llvm::cantFail(code.tracker->remove());
+            delete frame;
+            continue;
+        }
+
+        std::erase(pending_frames[frame->get_physical_page()], frame);
+        frame->tracker = code.tracker;
+        frame->function = code.function;
+        frame->chain_slots = code.chain_slots;
+        frame->chain_slot_count = code.chain_slot_count;
+        frame->exit_counts = code.exit_counts;
+        frame->exit_targets = std::move(code.exit_targets);
+        frame->code_size = code.code_size;
+        frame->ending_pc = instructions.back().pc;
+        frame->is_being_compiled = false;
+
+        // Only needed should the frame ever be re-optimised
+        if (options.hot_threshold != 0)
+            frame->instructions = std::move(instructions);
+
+        cache_frame(frame);
+    }
+}
+
+void JIT::install_optimised_frames()
+{
+    for (const auto& [frame, code, instructions] : take_compiled_frames(optimiser_queue))
+    {
+        if (frame->is_invalidated)
+        {
+            llvm::cantFail(code.tracker->remove());
+            delete frame;
+            continue;
+        }
+
+        // The trace starts with the frame's own instructions, but if it was
+        // cut short before the end of them it can't stand in for the frame;
+        // anything entering at a PC it's missing would run the wrong code.
+        // It's only ever reported hot the once, so stays at baseline.
+        if (instructions.size() < frame->instructions.size())
+        {
+            llvm::cantFail(code.tracker->remove());
+            frame->is_being_compiled = false;
+            frame->instructions = {};
+            continue;
+        }
+
+        // Our own slots are about to be freed along with the old code...
+        const auto is_frame = [&](const std::pair<Frame*, u64*>& chain) { return chain.first == frame; };
+        for (const auto& [target, slot] : std::exchange(frame->outgoing_chains, {}))
+            std::erase_if(target->incoming_chains, is_frame);
+
+        // ...but anything chained to us can go straight to the new code
+        for (const auto& [source, slot] : frame->incoming_chains)
+            *slot = reinterpret_cast<u64>(code.function);
+
+        llvm::cantFail(frame->tracker->remove());
+        code_bytes += code.code_size - frame->code_size;
+        peak_code_bytes = std::max(peak_code_bytes, code_bytes);
+        frame->code_size = code.code_size;
+        frame->tracker = code.tracker;
+        frame->function = code.function;
+        frame->chain_slots = code.chain_slots;
+        frame->chain_slot_count = code.chain_slot_count;
+        frame->exit_counts = nullptr;
+        frame->exit_targets = {};
+        frame->tier = Frame::Tier::Optimised;
+        frame->is_being_compiled = false;
+        frame->instructions = {};
     }
+}
+
+std::vector<CompileQueue::Result> JIT::take_compiled_frames(CompileQueue& queue)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    return std::exchange(queue.results, {});
+}
+
+void JIT::start_compiler(CompileQueue& queue)
+{
+    queue.thread = std::thread(run_compiler, &queue);
+}
+
+void JIT::stop_compiler(CompileQueue& queue)
+{
+    if (!queue.thread.joinable())
+        return;
 
-    return std::nullopt;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.is_stopping = true;
+    }
+    queue.condition.notify_one();
+    queue.thread.join();
+}
+
+void JIT::run_compiler(CompileQueue* queue)
+{
+    while (true)
+    {
+        CompileQueue::Job job;
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->condition.wait(lock, [&] { return queue->is_stopping || !queue->jobs.empty(); });
+            if (queue->is_stopping)
+                return;
+
+            job = std::move(queue->jobs.front());
+            queue->jobs.pop();
+        }
+
+        const auto start_time = std::chrono::steady_clock::now();
+        const FrameCode code = compile_frame(*job.cpu, *queue, job.instructions, job.frame);
+        const auto time = std::chrono::steady_clock::now() - start_time;
+
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->statistics.frames++;
+        queue->statistics.instructions += job.instructions.size();
+        queue->statistics.time += time;
+        queue->results.push_back({ job.frame, code, std::move(job.instructions) });
+    }
+}
+
+void JIT::optimise_module(llvm::Module& module)
+{
+    llvm::LoopAnalysisManager loop_analysis_manager;
+    llvm::FunctionAnalysisManager function_analysis_manager;
+    llvm::CGSCCAnalysisManager cgscc_analysis_manager;
+    llvm::ModuleAnalysisManager module_analysis_manager;
+
+    llvm::PassBuilder pass_builder;
+    pass_builder.registerModuleAnalyses(module_analysis_manager);
+    pass_builder.registerCGSCCAnalyses(cgscc_analysis_manager);
+    pass_builder.registerFunctionAnalyses(function_analysis_manager);
+    pass_builder.registerLoopAnalyses(loop_analysis_manager);
+    pass_builder.crossRegisterProxies(
+        loop_analysis_manager,
+        function_analysis_manager,
+        cgscc_analysis_manager,
+        module_analysis_manager
+    );
+
+    // Includes mem2reg, instcombine, GVN, etc.
+    llvm::ModulePassManager pass_manager = pass_builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+    pass_manager.run(module, module_analysis_manager);
+}
+
+void JIT::shut_down()
+{
+    stop_compiler(baseline_queue);
+    stop_compiler(optimiser_queue);
+
+    if (options.print_statistics)
+    {
+        const auto print = [](const char* tier, const CompileQueue::Statistics& statistics)
+        {
+            const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(statistics.time).count();
+            std::cerr << std::format(
+                "{}: {} frames ({} instructions) compiled in {} ms",
+                tier,
+                statistics.frames,
+                statistics.instructions,
+                milliseconds
+            ) << std::endl;
+        };
+        print("baseline", baseline_queue.statistics);
+        print("optimised", optimiser_queue.statistics);
+
+        const auto print_cache = [](const char* tier, const CodeCache* cache)
+        {
+            if (cache != nullptr)
+                std::cerr << std::format("{} cache: {} hits, {} misses", tier, cache->hits.load(), cache->misses.load()) << std::endl;
+        };
+        print_cache("baseline", baseline_cache.get());
+        print_cache("optimised", optimising_cache.get());
+
+        // IR is thrown away by ORC once it's compiled, so what stays around
+        // is the code itself and what we keep to describe it
+        u64 frames = 0;
+        u64 metadata_bytes = 0;
+        for (const auto& page : cached_frames)
+        {
+            for (const Frame* frame : page.second)
+            {
+                frames++;
+                metadata_bytes += frame->get_metadata_size();
+            }
+        }
+        std::cerr << std::format(
+            "code: {} KiB in {} frames (peak {} KiB), {} KiB metadata, {} frames evicted",
+            code_bytes / 1024,
+            frames,
+            peak_code_bytes / 1024,
+            metadata_bytes / 1024,
+            frames_evicted
+        ) << std::endl;
+    }
 }
 
 bool JIT::check_for_exceptions(CPU& cpu)
@@ -534,7 +1783,9 @@ bool JIT::emit_instruction(CPU& cpu, Context& context)
 
         case OPCODES_BASE_FENCE:
         {
-            // No cores; no need!
+            // No cores so ordinary fences are a no-op
+            if (funct3 == FENCE_I)
+                fence_i(context);
             break;
         }
 
@@ -1049,13 +2300,26 @@ bool JIT::emit_compressed_instruction(CPU& cpu, Context& context)
     return false;
 }
 
-llvm::Value* JIT::get_registers(CPU& cpu, llvm::IRBuilder<>& builder)
+/*
+    Host addresses are different every run, so to keep frames cacheable the
+    CPU's fields are reached by their offset from the cpu symbol, which is
+    only resolved when the frame's linked (see link_interface_functions).
+*/
+llvm::Value* JIT::get_cpu_field(
+    CPU& cpu,
+    llvm::IRBuilder<>& builder,
+    llvm::Module* module,
+    const void* field,
+    llvm::Type* type
+)
 {
-    llvm::Type* i64_ptr_type = builder.getInt64Ty()->getPointerTo();
-    return builder.CreateIntToPtr(
-        llvm::ConstantInt::get(builder.getInt64Ty(), reinterpret_cast<uint64_t>(cpu.registers)),
-        i64_ptr_type
+    const u64 offset = reinterpret_cast<const u8*>(field) - reinterpret_cast<const u8*>(&cpu);
+    llvm::Value* address = builder.CreateConstInBoundsGEP1_64(
+        builder.getInt8Ty(),
+        module->getOrInsertGlobal("cpu", builder.getInt8Ty()),
+        offset
     );
+    return builder.CreatePointerCast(address, type->getPointerTo());
 }
 
 llvm::Value* JIT::load_register(Context& context, u32 index)
@@ -1068,6 +2332,7 @@ llvm::Value* JIT::load_register(Context& context, u32 index)
     if (index == 0)
         return llvm::ConstantInt::get(context.builder.getInt64Ty(), 0);
 
+    context.read_registers.set(index);
     llvm::Value* index_value = llvm::ConstantInt::get(context.builder.getInt32Ty(), index);
     llvm::Value* element_pointer = context.builder.CreateGEP(
         context.builder.getInt64Ty(),
@@ -1087,6 +2352,7 @@ void JIT::store_register(Context& context, u32 index, llvm::Value* value)
     if (index == 0)
         return;
 
+    context.written_registers.set(index);
     llvm::Value* index_value = llvm::ConstantInt::get(context.builder.getInt32Ty(), index);
     llvm::Value* element_pointer = context.builder.CreateGEP(
         context.builder.getInt64Ty(),
@@ -1156,16 +2422,22 @@ u64 on_mret(u64 pc)
 u64 on_wfi(u64 pc)
 {
     interface_cpu->pc = pc;
+    interface_cpu->jit_budget = 0;
     ::wfi(*interface_cpu, Instruction(0));
     RETURN_FROM_OPCODE_HANDLER(4);
 }
 
-u64 on_sfence_vma(u64 pc)
+u64 on_fence_i(u64 pc)
 {
-    // sfence.vma doesn't care about the instruction currently but might in
-    // the future when we support partial TLB invalidations
     interface_cpu->pc = pc;
-    ::sfence_vma(*interface_cpu, Instruction(0));
+    ::fence_i(*interface_cpu, Instruction(0));
+    RETURN_FROM_OPCODE_HANDLER(4);
+}
+
+u64 on_sfence_vma(Instruction instruction, u64 pc)
+{
+    interface_cpu->pc = pc;
+    ::sfence_vma(*interface_cpu, instruction);
     RETURN_FROM_OPCODE_HANDLER(4);
 }
 
@@ -1189,6 +2461,10 @@ T on_load(u64 address, u64 pc, bool* did_succeed)
         return 0;
     }
 
+    // Next time round the JIT'd code might be able to do it itself
+    if (address % sizeof(T) == 0)
+        interface_cpu->fill_fast_tlb(address, CPU::AccessType::Load);
+
     *did_succeed = true;
     return *value;
 }
@@ -1212,7 +2488,7 @@ u32 on_lw(u64 address, u64 pc, bool* did_succeed)
     return on_load<&CPU::read_32, u32>(address, pc, did_succeed);
 }
 
-u32 on_ld(u64 address, u64 pc, bool* did_succeed)
+u64 on_ld(u64 address, u64 pc, bool* did_succeed)
 {
     return on_load<&CPU::read_64, u64>(address, pc, did_succeed);
 }
@@ -1227,6 +2503,14 @@ bool on_store(u64 address, T value, u64 pc)
         interface_cpu->raise_exception(*error);
         return false;
     }
+
+    if (address % sizeof(T) == 0)
+        interface_cpu->fill_fast_tlb(address, CPU::AccessType::Store);
+
+    // Overwrote some code, which might even be this frame's
+    if (!interface_cpu->bus.written_code_pages.empty()) [[unlikely]]
+        interface_cpu->jit_budget = 0;
+
     return true;
 }
 
@@ -1252,11 +2536,22 @@ bool on_sd(u64 address, u64 value, u64 pc)
 
 bool on_csr(Instruction instruction, u64 pc)
 {
+    // fflags might be read or written
+    collect_fp_exceptions(*interface_cpu);
     interface_cpu->pc = pc;
     ::opcodes_zicsr(*interface_cpu, instruction);
-    interface_cpu->check_for_invalid_tlb();
+    interface_cpu->update_tlb_permissions();
     interface_cpu->registers[0] = 0;
 
+    // An interrupt might've just been enabled, so don't keep it waiting
+    switch (instruction.get_imm(Instruction::Type::I) & 0xfff)
+    {
+        case CSR_SSTATUS: case CSR_SIE: case CSR_SIP:
+        case CSR_MSTATUS: case CSR_MIE: case CSR_MIP:
+            interface_cpu->jit_budget = 0;
+            break;
+    }
+
     // Return if an exception occured or the TLB was invalidated
     // All the PC logic goes to great lengths to preserve the PC
     // when we return false so we'll have to be a bit creative
@@ -1269,6 +2564,12 @@ void set_fcsr_dz()
     interface_cpu->fcsr.set_dz(*interface_cpu);
 }
 
+void on_hot_frame(u64 frame)
+{
+    // Can't be queued for the optimiser until it's stopped running
+    hot_frames.push_back(reinterpret_cast<Frame*>(frame));
+}
+
 bool on_atomic(Instruction instruction, u64 pc)
 {
     interface_cpu->pc = pc;
@@ -1279,6 +2580,8 @@ bool on_atomic(Instruction instruction, u64 pc)
 
 bool on_floating(Instruction instruction, u64 pc)
 {
+    // The interpreter clears the host's exceptions before it starts
+    collect_fp_exceptions(*interface_cpu);
     interface_cpu->pc = pc;
     ::opcodes_f(*interface_cpu, instruction);
     interface_cpu->registers[0] = 0;
@@ -1399,6 +2702,17 @@ void JIT::register_interface_functions(
             false\
         )
 
+    #define OPCODE_TYPE_5(return_type)\
+        llvm::FunctionType::get\
+        (\
+            return_type,\
+            {\
+                llvm::Type::getInt32Ty(context),\
+                llvm::Type::getInt64Ty(context)\
+            },\
+            false\
+        )
+
     #define OPCODE(name, return_type)\
         jit_context.name = llvm::Function::Create(\
             return_type,\
@@ -1414,7 +2728,8 @@ void JIT::register_interface_functions(
     OPCODE(on_sret,         OPCODE_TYPE_1(llvm::Type::getInt64Ty(context)));
     OPCODE(on_mret,         OPCODE_TYPE_1(llvm::Type::getInt64Ty(context)));
     OPCODE(on_wfi,          OPCODE_TYPE_1(llvm::Type::getInt64Ty(context)));
-    OPCODE(on_sfence_vma,   OPCODE_TYPE_1(llvm::Type::getInt64Ty(context)));
+    OPCODE(on_sfence_vma,   OPCODE_TYPE_5(llvm::Type::getInt64Ty(context)));
+    OPCODE(on_fence_i,      OPCODE_TYPE_1(llvm::Type::getInt64Ty(context)));
     OPCODE(on_lb,           OPCODE_TYPE_2(llvm::Type::getInt8Ty(context)));
     OPCODE(on_lh,           OPCODE_TYPE_2(llvm::Type::getInt16Ty(context)));
     OPCODE(on_lw,           OPCODE_TYPE_2(llvm::Type::getInt32Ty(context)));
@@ -1425,6 +2740,15 @@ void JIT::register_interface_functions(
     OPCODE(on_sd,           OPCODE_TYPE_3(llvm::Type::getInt64Ty(context)));
     OPCODE(set_fcsr_dz,     OPCODE_TYPE_4());
 
+    // Loads and stores only call out when they miss the fast TLB
+    for (llvm::Function* function : {
+        jit_context.on_lb, jit_context.on_lh, jit_context.on_lw, jit_context.on_ld,
+        jit_context.on_sb, jit_context.on_sh, jit_context.on_sw, jit_context.on_sd
+    })
+        function->addFnAttr(llvm::Attribute::Cold);
+
+    OPCODE(on_hot_frame,    llvm::FunctionType::get(llvm::Type::getVoidTy(context), { llvm::Type::getInt64Ty(context) }, false));
+
     FALLBACK(on_csr);
     FALLBACK(on_atomic);
     FALLBACK(on_floating);
@@ -1451,13 +2775,15 @@ void JIT::register_interface_functions(
 #endif
 }
 
-void JIT::link_interface_functions(
-    llvm::ExecutionEngine* engine,
-    Context& jit_context
-)
+void JIT::link_interface_functions(llvm::orc::LLJIT& session, CPU& cpu)
 {
+    llvm::orc::SymbolMap symbols;
+
     #define LINK(name)\
-        engine->addGlobalMapping(jit_context.name, (void*)&name);
+        symbols[session.mangleAndIntern(#name)] = llvm::orc::ExecutorSymbolDef(\
+            llvm::orc::ExecutorAddr::fromPtr(&name),\
+            llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable\
+        );
 
     LINK(on_ecall);
     LINK(on_ebreak);
@@ -1467,6 +2793,7 @@ void JIT::link_interface_functions(
     LINK(on_mret);
     LINK(on_wfi);
     LINK(on_sfence_vma);
+    LINK(on_fence_i);
     LINK(on_lb);
     LINK(on_lh);
     LINK(on_lw);
@@ -1476,14 +2803,35 @@ void JIT::link_interface_functions(
     LINK(on_sw);
     LINK(on_sd);
     LINK(set_fcsr_dz);
+    LINK(on_hot_frame);
 
     LINK(on_csr);
     LINK(on_atomic);
     LINK(on_floating);
     LINK(on_floating_compressed);
 
+    // Data frames use in place, for the same reason (see get_cpu_field)
+    #define LINK_DATA(name, address)\
+        symbols[session.mangleAndIntern(name)] = llvm::orc::ExecutorSymbolDef(\
+            llvm::orc::ExecutorAddr::fromPtr(address),\
+            llvm::JITSymbolFlags::Exported\
+        );
+
+    LINK_DATA("cpu", &cpu);
+    LINK_DATA("pending_chain_slot", &pending_chain_slot);
+
 #if DEBUG_JIT
-    engine->addGlobalMapping(debug_trace, (void*)&on_debug_trace);
-    engine->addGlobalMapping(debug_print, (void*)&on_debug_print);
+    symbols[session.mangleAndIntern("debug_trace")] = llvm::orc::ExecutorSymbolDef(
+        llvm::orc::ExecutorAddr::fromPtr(&on_debug_trace),
+        llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable
+    );
+    symbols[session.mangleAndIntern("debug_print")] = llvm::orc::ExecutorSymbolDef(
+        llvm::orc::ExecutorAddr::fromPtr(&on_debug_print),
+        llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable
+    );
 #endif
+
+    llvm::Error error = session.getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(symbols)));
+    if (error)
+        throw std::runtime_error("failed to define interface functions: " + llvm::toString(std::move(error)));
 }
@@ -4,26 +4,240 @@
 
 using namespace JIT;
 
-void JIT::lr_w     (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::sc_w     (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoswap_w(Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoadd_w (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoxor_w (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoand_w (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoor_w  (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amomin_w (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amomax_w (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amominu_w(Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amomaxu_w(Context& context) { fall_back(context.on_atomic, context); }
-
-void JIT::lr_d     (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::sc_d     (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoswap_d(Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoadd_d (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoxor_d (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoand_d (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amoor_d  (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amomin_d (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amomax_d (Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amominu_d(Context& context) { fall_back(context.on_atomic, context); }
-void JIT::amomaxu_d(Context& context) { fall_back(context.on_atomic, context); }
\ No newline at end of file
+/*
+    There's only the one hart, so an AMO can be a plain load, op and store
+    through the fast TLB, and the reservation a single address that LR sets
+    and SC checks and clears (see Bus::reservation). Misaligned addresses
+    raise an exception, which is left to the interpreter.
+*/
+template<typename F>
+static void emit_atomic(Context& context, u64 size, F&& emit);
+
+template<typename F>
+static void emit_amo_w(Context& context, F&& op);
+
+template<typename F>
+static void emit_amo_d(Context& context, F&& op);
+
+static void emit_sc(Context& context, llvm::Value* address, llvm::Function* on_store, llvm::Value* value);
+
+void JIT::lr_w(Context& context)
+{
+    emit_atomic(context, 4, [](Context& context, llvm::Value* address)
+    {
+        llvm::Value* value = perform_load(context, context.on_lw, [&](Context&) { return address; });
+        context.builder.CreateStore(address, context.reservation);
+        set_rd(sign_extend(context, value));
+    });
+}
+
+void JIT::sc_w(Context& context)
+{
+    emit_atomic(context, 4, [](Context& context, llvm::Value* address)
+    {
+        emit_sc(context, address, context.on_sw, u64_to_32(rs2));
+    });
+}
+
+void JIT::amoswap_w(Context& context)
+{
+    emit_amo_w(context, [](Context&, llvm::Value*, llvm::Value* b) { return b; });
+}
+
+void JIT::amoadd_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateAdd(a, b); });
+}
+
+void JIT::amoxor_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateXor(a, b); });
+}
+
+void JIT::amoand_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateAnd(a, b); });
+}
+
+void JIT::amoor_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateOr(a, b); });
+}
+
+void JIT::amomin_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpSLT(a, b), a, b);
+    });
+}
+
+void JIT::amomax_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpSGT(a, b), a, b);
+    });
+}
+
+void JIT::amominu_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpULT(a, b), a, b);
+    });
+}
+
+void JIT::amomaxu_w(Context& context)
+{
+    emit_amo_w(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpUGT(a, b), a, b);
+    });
+}
+
+void JIT::lr_d(Context& context)
+{
+    emit_atomic(context, 8, [](Context& context, llvm::Value* address)
+    {
+        llvm::Value* value = perform_load(context, context.on_ld, [&](Context&) { return address; });
+        context.builder.CreateStore(address, context.reservation);
+        set_rd(value);
+    });
+}
+
+void JIT::sc_d(Context& context)
+{
+    emit_atomic(context, 8, [](Context& context, llvm::Value* address)
+    {
+        emit_sc(context, address, context.on_sd, rs2);
+    });
+}
+
+void JIT::amoswap_d(Context& context)
+{
+    emit_amo_d(context, [](Context&, llvm::Value*, llvm::Value* b) { return b; });
+}
+
+void JIT::amoadd_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateAdd(a, b); });
+}
+
+void JIT::amoxor_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateXor(a, b); });
+}
+
+void JIT::amoand_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateAnd(a, b); });
+}
+
+void JIT::amoor_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b) { return context.builder.CreateOr(a, b); });
+}
+
+void JIT::amomin_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpSLT(a, b), a, b);
+    });
+}
+
+void JIT::amomax_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpSGT(a, b), a, b);
+    });
+}
+
+void JIT::amominu_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpULT(a, b), a, b);
+    });
+}
+
+void JIT::amomaxu_d(Context& context)
+{
+    emit_amo_d(context, [](Context& context, llvm::Value* a, llvm::Value* b)
+    {
+        return context.builder.CreateSelect(context.builder.CreateICmpUGT(a, b), a, b);
+    });
+}
+
+// -- Helpers --
+
+template<typename F>
+static void emit_atomic(Context& context, u64 size, F&& emit)
+{
+    // Misaligned - raise the exception
+    llvm::Value* address = rs1;
+    llvm::Value* is_aligned = context.builder.CreateICmpEQ(
+        context.builder.CreateAnd(address, u64_im(size - 1)),
+        u64_im(0)
+    );
+    emit_or_fall_back(context, is_aligned, context.on_atomic, [&](Context& context)
+    {
+        emit(context, address);
+    });
+}
+
+template<typename F>
+static void emit_amo_w(Context& context, F&& op)
+{
+    emit_atomic(context, 4, [&](Context& context, llvm::Value* address)
+    {
+        // rs2 has to be read before rd is written, in case they're the same
+        llvm::Value* value = perform_load(context, context.on_lw, [&](Context&) { return address; });
+        llvm::Value* result = op(context, value, u64_to_32(rs2));
+        perform_store(context, context.on_sw, result, [&](Context&) { return address; });
+        set_rd(sign_extend(context, value));
+    });
+}
+
+template<typename F>
+static void emit_amo_d(Context& context, F&& op)
+{
+    emit_atomic(context, 8, [&](Context& context, llvm::Value* address)
+    {
+        llvm::Value* value = perform_load(context, context.on_ld, [&](Context&) { return address; });
+        llvm::Value* result = op(context, value, rs2);
+        perform_store(context, context.on_sd, result, [&](Context&) { return address; });
+        set_rd(value);
+    });
+}
+
+static void emit_sc(Context& context, llvm::Value* address, llvm::Function* on_store, llvm::Value* value)
+{
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Function* function = builder.GetInsertBlock()->getParent();
+
+    // The reservation's gone either way
+    llvm::Value* reservation = builder.CreateLoad(builder.getInt64Ty(), context.reservation);
+    builder.CreateStore(u64_im(Bus::no_reservation), context.reservation);
+
+    llvm::BasicBlock* store_block = llvm::BasicBlock::Create(context.context);
+    llvm::BasicBlock* failure_block = llvm::BasicBlock::Create(context.context);
+    llvm::BasicBlock* done_block = llvm::BasicBlock::Create(context.context);
+    builder.CreateCondBr(builder.CreateICmpEQ(reservation, address), store_block, failure_block);
+
+    function->insert(function->end(), store_block);
+    builder.SetInsertPoint(store_block);
+    perform_store(context, on_store, value, [&](Context&) { return address; });
+    set_rd(u64_im(0));
+    builder.CreateBr(done_block);
+
+    function->insert(function->end(), failure_block);
+    builder.SetInsertPoint(failure_block);
+    set_rd(u64_im(1));
+    builder.CreateBr(done_block);
+
+    function->insert(function->end(), done_block);
+    builder.SetInsertPoint(done_block);
+}
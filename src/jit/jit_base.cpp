@@ -245,7 +245,7 @@ void JIT::jal(Context& context)
         context.current_instruction.get_rd(),
         u64_im(context.pc + 4)
     );
-    create_non_terminating_return(context, u64_im(context.pc + offset));
+    create_static_exit(context, context.pc + offset);
 }
 
 void JIT::jalr(Context& context)
@@ -311,7 +311,22 @@ void JIT::wfi(Context& context)
 
 void JIT::sfence_vma(Context& context)
 {
-    call_handler_and_return(context, context.on_sfence_vma);
+    // rs1 and rs2 say what's to be flushed
+    create_non_terminating_return(
+        context,
+        context.builder.CreateCall(context.on_sfence_vma, {
+            u32_im(context.current_instruction.instruction),
+            u64_im(context.pc)
+        }),
+        nullptr
+    );
+}
+
+void JIT::fence_i(Context& context)
+{
+    // The frame we're in might be about to be thrown away, so don't carry on
+    call_handler_and_return(context, context.on_fence_i);
+    context.abort_translation = true;
 }
 
 void JIT::lwu(Context& context)
@@ -404,21 +419,8 @@ static void emit_branch(Context& context, llvm::Value* condition)
     if ((target & 0b1) != 0)
         std::runtime_error("todo: raise exception on unaligned jump");
 
-    llvm::Function* function = context.builder.GetInsertBlock()->getParent();
-
-    // Create blocks
-    llvm::BasicBlock* true_block = llvm::BasicBlock::Create(context.context);
-    llvm::BasicBlock* false_block = llvm::BasicBlock::Create(context.context);
-    context.builder.CreateCondBr(condition, true_block, false_block);
-
-    // True block - unable to JIT further (for now!) so return early
-    context.builder.SetInsertPoint(true_block);
-    context.builder.CreateRet(u64_im(context.pc + target));
-    function->insert(function->end(), true_block);
-
-    // False block - merge back
-    function->insert(function->end(), false_block);
-    context.builder.SetInsertPoint(false_block);
+    // Taken branches leave for the target; otherwise carry on
+    create_static_exit(context, context.pc + target, condition);
 }
 
 static llvm::Value* get_load_address(Context& context)
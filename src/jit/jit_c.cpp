@@ -104,9 +104,10 @@ void JIT::c_sdsp(Context& context)
 void JIT::c_j(Context& context)
 {
     // As with an uncompressed jump, we can't just "simulate it" as you'd think
-    create_non_terminating_return(context, u64_im(
+    create_static_exit(
+        context,
         context.pc + context.current_compressed_instruction.get_jump_offset()
-    ));
+    );
 }
 
 void JIT::c_jr(Context& context)
@@ -303,19 +304,6 @@ static void emit_compressed_branch(Context& context, llvm::Value* condition)
     if ((target & 0b1) != 0)
         std::runtime_error("todo: raise exception on unaligned jump");
 
-    llvm::Function* function = context.builder.GetInsertBlock()->getParent();
-
-    // Create blocks
-    llvm::BasicBlock* true_block = llvm::BasicBlock::Create(context.context);
-    llvm::BasicBlock* false_block = llvm::BasicBlock::Create(context.context);
-    context.builder.CreateCondBr(condition, true_block, false_block);
-
-    // True block - unable to JIT further (for now!) so return early
-    context.builder.SetInsertPoint(true_block);
-    context.builder.CreateRet(u64_im(context.pc + target));
-    function->insert(function->end(), true_block);
-
-    // False block - merge back
-    function->insert(function->end(), false_block);
-    context.builder.SetInsertPoint(false_block);
+    // Taken branches leave for the target; otherwise carry on
+    create_static_exit(context, context.pc + target, condition);
 }
@@ -0,0 +1,59 @@
+#include "jit/jit_cache.h"
+
+using namespace JIT;
+
+CodeCache::CodeCache(const std::filesystem::path& root, const std::string& tier)
+{
+    const std::string host = std::format("llvm-{}-{}", LLVM_VERSION_STRING, llvm::sys::getHostCPUName().str());
+    directory = root / host / tier;
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error)
+        throw std::runtime_error("failed to create JIT cache " + directory.string() + ": " + error.message());
+}
+
+void CodeCache::notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object)
+{
+    // Written under a temporary name then renamed into place, so that neither
+    // the other tier nor another run can ever see half an object
+    const std::filesystem::path path = get_path(*module);
+    const std::filesystem::path temporary_path = path.string() + std::format(".{}.tmp", getpid());
+    {
+        std::ofstream file(temporary_path, std::ios::binary);
+        file.write(object.getBufferStart(), object.getBufferSize());
+        if (!file)
+            return;
+    }
+
+    // Not being able to cache something isn't worth stopping for
+    std::error_code error;
+    std::filesystem::rename(temporary_path, path, error);
+    if (error)
+        std::filesystem::remove(temporary_path, error);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> CodeCache::getObject(const llvm::Module* module)
+{
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> object =
+        llvm::MemoryBuffer::getFile(get_path(*module).string(), false, false);
+    if (!object)
+    {
+        misses++;
+        return nullptr;
+    }
+
+    hits++;
+    return std::move(*object);
+}
+
+bool CodeCache::contains(const llvm::Module& module) const
+{
+    std::error_code error;
+    return std::filesystem::exists(get_path(module), error);
+}
+
+std::filesystem::path CodeCache::get_path(const llvm::Module& module) const
+{
+    return directory / (module.getModuleIdentifier() + ".o");
+}
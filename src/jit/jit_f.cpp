@@ -1,51 +1,413 @@
 #define JIT_ENABLE_FALLBACK
 #include "jit/jit_f.h"
 #include "jit/jit_common.h"
+#include "opcodes_f.h"
 
 using namespace JIT;
 
-void JIT::flw        (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fld        (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsw        (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsd        (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmadd_s    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmadd_d    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmsub_s    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmsub_d    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fnmadd_s   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fnmadd_d   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fnmsub_s   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fnmsub_d   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fadd_s     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fadd_d     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsub_s     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsub_d     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmul_s     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmul_d     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fdiv_s     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fdiv_d     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsqrt_s    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsqrt_d    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsgnj_s    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsgnj_d    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsgnjn_s   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsgnjn_d   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsgnjx_s   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fsgnjx_d   (Context& context) { fall_back(context.on_floating, context); }
+#define frs1 context.current_instruction.get_rs1()
+#define frs2 context.current_instruction.get_rs2()
+#define frs3 context.current_instruction.get_rs3()
+#define frd context.current_instruction.get_rd()
+
+/*
+    Floating point is done in place on the guest's registers using LLVM's
+    constrained operations, which round to nearest and raise exceptions on the
+    host FPU just like the interpreter, and which LLVM won't reorder or fold
+    away as a result. Those exceptions are only copied into fcsr once the
+    frame returns (see JIT::collect_fp_exceptions).
+
+    Other rounding modes, an FPU that's been turned off, and the instructions
+    not done here (min/max, classification, conversions to integers) are all
+    left to the interpreter.
+*/
+template<typename F>
+static void emit_floating(Context& context, bool is_write, bool is_rounded, F&& emit, bool is_compressed = false);
+
+static llvm::Value* load_float(Context& context, u32 index);
+static llvm::Value* load_double(Context& context, u32 index);
+static llvm::Value* load_bits(Context& context, u32 index);
+static void store_float(Context& context, u32 index, llvm::Value* value);
+static void store_double(Context& context, u32 index, llvm::Value* value);
+static void store_bits(Context& context, u32 index, llvm::Value* value);
+static llvm::Value* box(Context& context, llvm::Value* value);
+static llvm::Value* call_intrinsic(Context& context, llvm::Intrinsic::ID id, llvm::Value* value);
+static llvm::Value* get_load_address(Context& context);
+static llvm::Value* get_store_address(Context& context);
+
+void JIT::flw(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* value = perform_load(context, context.on_lw, get_load_address);
+        store_bits(context, frd, box(context, value));
+    });
+}
+
+void JIT::fld(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        store_bits(context, frd, perform_load(context, context.on_ld, get_load_address));
+    });
+}
+
+void JIT::fsw(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        // Stored as is, boxed or not
+        perform_store(context, context.on_sw, u64_to_32(load_bits(context, frs2)), get_store_address);
+    });
+}
+
+void JIT::fsd(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        perform_store(context, context.on_sd, load_bits(context, frs2), get_store_address);
+    });
+}
+
+/*
+    NOTE: Like the interpreter these round twice, rather than once like a
+          real fused multiply-add, and the negated forms follow its naming.
+*/
+void JIT::fmadd_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* product = context.builder.CreateFMul(load_float(context, frs1), load_float(context, frs2));
+        store_float(context, frd, context.builder.CreateFAdd(product, load_float(context, frs3)));
+    });
+}
+
+void JIT::fmadd_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* product = context.builder.CreateFMul(load_double(context, frs1), load_double(context, frs2));
+        store_double(context, frd, context.builder.CreateFAdd(product, load_double(context, frs3)));
+    });
+}
+
+void JIT::fmsub_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* product = context.builder.CreateFMul(load_float(context, frs1), load_float(context, frs2));
+        store_float(context, frd, context.builder.CreateFSub(product, load_float(context, frs3)));
+    });
+}
+
+void JIT::fmsub_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* product = context.builder.CreateFMul(load_double(context, frs1), load_double(context, frs2));
+        store_double(context, frd, context.builder.CreateFSub(product, load_double(context, frs3)));
+    });
+}
+
+void JIT::fnmadd_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* a = context.builder.CreateFNeg(load_float(context, frs1));
+        llvm::Value* product = context.builder.CreateFMul(a, load_float(context, frs2));
+        store_float(context, frd, context.builder.CreateFAdd(product, load_float(context, frs3)));
+    });
+}
+
+void JIT::fnmadd_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* a = context.builder.CreateFNeg(load_double(context, frs1));
+        llvm::Value* product = context.builder.CreateFMul(a, load_double(context, frs2));
+        store_double(context, frd, context.builder.CreateFAdd(product, load_double(context, frs3)));
+    });
+}
+
+void JIT::fnmsub_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* a = context.builder.CreateFNeg(load_float(context, frs1));
+        llvm::Value* product = context.builder.CreateFMul(a, load_float(context, frs2));
+        store_float(context, frd, context.builder.CreateFSub(product, load_float(context, frs3)));
+    });
+}
+
+void JIT::fnmsub_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* a = context.builder.CreateFNeg(load_double(context, frs1));
+        llvm::Value* product = context.builder.CreateFMul(a, load_double(context, frs2));
+        store_double(context, frd, context.builder.CreateFSub(product, load_double(context, frs3)));
+    });
+}
+
+void JIT::fadd_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_float(context, frd, context.builder.CreateFAdd(load_float(context, frs1), load_float(context, frs2)));
+    });
+}
+
+void JIT::fadd_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_double(context, frd, context.builder.CreateFAdd(load_double(context, frs1), load_double(context, frs2)));
+    });
+}
+
+void JIT::fsub_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_float(context, frd, context.builder.CreateFSub(load_float(context, frs1), load_float(context, frs2)));
+    });
+}
+
+void JIT::fsub_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_double(context, frd, context.builder.CreateFSub(load_double(context, frs1), load_double(context, frs2)));
+    });
+}
+
+void JIT::fmul_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_float(context, frd, context.builder.CreateFMul(load_float(context, frs1), load_float(context, frs2)));
+    });
+}
+
+void JIT::fmul_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_double(context, frd, context.builder.CreateFMul(load_double(context, frs1), load_double(context, frs2)));
+    });
+}
+
+void JIT::fdiv_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_float(context, frd, context.builder.CreateFDiv(load_float(context, frs1), load_float(context, frs2)));
+    });
+}
+
+void JIT::fdiv_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        store_double(context, frd, context.builder.CreateFDiv(load_double(context, frs1), load_double(context, frs2)));
+    });
+}
+
+void JIT::fsqrt_s(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* a = load_float(context, frs1);
+        store_float(context, frd, call_intrinsic(context, llvm::Intrinsic::experimental_constrained_sqrt, a));
+    });
+}
+
+void JIT::fsqrt_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* a = load_double(context, frs1);
+        store_double(context, frd, call_intrinsic(context, llvm::Intrinsic::experimental_constrained_sqrt, a));
+    });
+}
+
+/*
+    Sign injection only moves bits about, so is done on the integer side
+    where there's no chance of an exception, and NaNs are left alone.
+*/
+void JIT::fsgnj_s(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* a = context.builder.CreateBitCast(load_float(context, frs1), context.builder.getInt32Ty());
+        llvm::Value* b = context.builder.CreateBitCast(load_float(context, frs2), context.builder.getInt32Ty());
+        llvm::Value* result = context.builder.CreateOr(
+            context.builder.CreateAnd(a, u32_im(0x7fffffff)),
+            context.builder.CreateAnd(b, u32_im(0x80000000))
+        );
+        store_bits(context, frd, box(context, result));
+    });
+}
+
+void JIT::fsgnj_d(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* a = load_bits(context, frs1);
+        llvm::Value* b = load_bits(context, frs2);
+        llvm::Value* result = context.builder.CreateOr(
+            context.builder.CreateAnd(a, u64_im(0x7fffffffffffffff)),
+            context.builder.CreateAnd(b, u64_im(0x8000000000000000))
+        );
+        store_bits(context, frd, result);
+    });
+}
+
+void JIT::fsgnjn_s(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* a = context.builder.CreateBitCast(load_float(context, frs1), context.builder.getInt32Ty());
+        llvm::Value* b = context.builder.CreateBitCast(load_float(context, frs2), context.builder.getInt32Ty());
+        llvm::Value* result = context.builder.CreateOr(
+            context.builder.CreateAnd(a, u32_im(0x7fffffff)),
+            context.builder.CreateAnd(context.builder.CreateNot(b), u32_im(0x80000000))
+        );
+        store_bits(context, frd, box(context, result));
+    });
+}
+
+void JIT::fsgnjn_d(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* a = load_bits(context, frs1);
+        llvm::Value* b = load_bits(context, frs2);
+        llvm::Value* result = context.builder.CreateOr(
+            context.builder.CreateAnd(a, u64_im(0x7fffffffffffffff)),
+            context.builder.CreateAnd(context.builder.CreateNot(b), u64_im(0x8000000000000000))
+        );
+        store_bits(context, frd, result);
+    });
+}
+
+void JIT::fsgnjx_s(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* a = context.builder.CreateBitCast(load_float(context, frs1), context.builder.getInt32Ty());
+        llvm::Value* b = context.builder.CreateBitCast(load_float(context, frs2), context.builder.getInt32Ty());
+        llvm::Value* result = context.builder.CreateXor(a, context.builder.CreateAnd(b, u32_im(0x80000000)));
+        store_bits(context, frd, box(context, result));
+    });
+}
+
+void JIT::fsgnjx_d(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* a = load_bits(context, frs1);
+        llvm::Value* b = load_bits(context, frs2);
+        llvm::Value* result = context.builder.CreateXor(a, context.builder.CreateAnd(b, u64_im(0x8000000000000000)));
+        store_bits(context, frd, result);
+    });
+}
+
 void JIT::fmin_s     (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fmin_d     (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fmax_s     (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fmax_d     (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_s_w   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_s_d   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_d_s   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_d_w   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_s_l   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_d_l   (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_s_wu  (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_d_wu  (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_s_lu  (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fcvt_d_lu  (Context& context) { fall_back(context.on_floating, context); }
+
+void JIT::fcvt_s_w(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateSIToFP(u64_to_32(rs1), context.builder.getFloatTy());
+        store_float(context, frd, value);
+    });
+}
+
+void JIT::fcvt_s_d(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateFPTrunc(load_double(context, frs1), context.builder.getFloatTy());
+        store_float(context, frd, value);
+    });
+}
+
+void JIT::fcvt_d_s(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateFPExt(load_float(context, frs1), context.builder.getDoubleTy());
+        store_double(context, frd, value);
+    });
+}
+
+void JIT::fcvt_d_w(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateSIToFP(u64_to_32(rs1), context.builder.getDoubleTy());
+        store_double(context, frd, value);
+    });
+}
+
+void JIT::fcvt_s_l(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateSIToFP(rs1, context.builder.getFloatTy());
+        store_float(context, frd, value);
+    });
+}
+
+void JIT::fcvt_d_l(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateSIToFP(rs1, context.builder.getDoubleTy());
+        store_double(context, frd, value);
+    });
+}
+
+void JIT::fcvt_s_wu(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateUIToFP(u64_to_32(rs1), context.builder.getFloatTy());
+        store_float(context, frd, value);
+    });
+}
+
+void JIT::fcvt_d_wu(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateUIToFP(u64_to_32(rs1), context.builder.getDoubleTy());
+        store_double(context, frd, value);
+    });
+}
+
+void JIT::fcvt_s_lu(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateUIToFP(rs1, context.builder.getFloatTy());
+        store_float(context, frd, value);
+    });
+}
+
+void JIT::fcvt_d_lu(Context& context)
+{
+    emit_floating(context, true, true, [](Context& context)
+    {
+        llvm::Value* value = context.builder.CreateUIToFP(rs1, context.builder.getDoubleTy());
+        store_double(context, frd, value);
+    });
+}
+
 void JIT::fcvt_w_s   (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fcvt_w_d   (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fcvt_l_s   (Context& context) { fall_back(context.on_floating, context); }
@@ -54,20 +416,307 @@ void JIT::fcvt_wu_s  (Context& context) { fall_back(context.on_floating, context
 void JIT::fcvt_wu_d  (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fcvt_lu_s  (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fcvt_lu_d  (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmv_x_w    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmv_x_d    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmv_w_x    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fmv_d_x    (Context& context) { fall_back(context.on_floating, context); }
-void JIT::feq_s      (Context& context) { fall_back(context.on_floating, context); }
-void JIT::feq_d      (Context& context) { fall_back(context.on_floating, context); }
-void JIT::flt_s      (Context& context) { fall_back(context.on_floating, context); }
-void JIT::flt_d      (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fle_s      (Context& context) { fall_back(context.on_floating, context); }
-void JIT::fle_d      (Context& context) { fall_back(context.on_floating, context); }
+
+void JIT::fmv_x_w(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        set_rd(sign_extend_32_as_64(context, load_bits(context, frs1)));
+    });
+}
+
+void JIT::fmv_x_d(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        set_rd(load_bits(context, frs1));
+    });
+}
+
+void JIT::fmv_w_x(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        store_bits(context, frd, box(context, u64_to_32(rs1)));
+    });
+}
+
+void JIT::fmv_d_x(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        store_bits(context, frd, rs1);
+    });
+}
+
+// feq is quiet, but flt and fle signal on any NaN
+void JIT::feq_s(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        set_rd(zero_extend(context, context.builder.CreateFCmpOEQ(load_float(context, frs1), load_float(context, frs2))));
+    });
+}
+
+void JIT::feq_d(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        set_rd(zero_extend(context, context.builder.CreateFCmpOEQ(load_double(context, frs1), load_double(context, frs2))));
+    });
+}
+
+void JIT::flt_s(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        llvm::Value* a = load_float(context, frs1);
+        llvm::Value* b = load_float(context, frs2);
+        set_rd(zero_extend(context, context.builder.CreateFCmpS(llvm::CmpInst::FCMP_OLT, a, b)));
+    });
+}
+
+void JIT::flt_d(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        llvm::Value* a = load_double(context, frs1);
+        llvm::Value* b = load_double(context, frs2);
+        set_rd(zero_extend(context, context.builder.CreateFCmpS(llvm::CmpInst::FCMP_OLT, a, b)));
+    });
+}
+
+void JIT::fle_s(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        llvm::Value* a = load_float(context, frs1);
+        llvm::Value* b = load_float(context, frs2);
+        set_rd(zero_extend(context, context.builder.CreateFCmpS(llvm::CmpInst::FCMP_OLE, a, b)));
+    });
+}
+
+void JIT::fle_d(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        llvm::Value* a = load_double(context, frs1);
+        llvm::Value* b = load_double(context, frs2);
+        set_rd(zero_extend(context, context.builder.CreateFCmpS(llvm::CmpInst::FCMP_OLE, a, b)));
+    });
+}
+
 void JIT::fclass_s   (Context& context) { fall_back(context.on_floating, context); }
 void JIT::fclass_d   (Context& context) { fall_back(context.on_floating, context); }
 
-void JIT::c_fldsp    (Context& context) { fall_back(context.on_floating_compressed, context, true); }
-void JIT::c_fsdsp    (Context& context) { fall_back(context.on_floating_compressed, context, true); }
-void JIT::c_fld      (Context& context) { fall_back(context.on_floating_compressed, context, true); }
-void JIT::c_fsd      (Context& context) { fall_back(context.on_floating_compressed, context, true); }
+void JIT::c_fldsp(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* value = perform_load(context, context.on_ld, [](Context& context)
+        {
+            const auto offset = context.current_compressed_instruction.get_ldsp_offset();
+            return context.builder.CreateAdd(
+                sp,
+                u64_im(offset)
+            );
+        });
+        store_bits(context, context.current_compressed_instruction.get_rd(), value);
+    }, true);
+}
+
+void JIT::c_fsdsp(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        llvm::Value* value = load_bits(context, context.current_compressed_instruction.get_rs2());
+        perform_store(context, context.on_sd, value, [](Context& context)
+        {
+            const auto offset = context.current_compressed_instruction.get_sdsp_offset();
+            return context.builder.CreateAdd(
+                sp,
+                u64_im(offset)
+            );
+        });
+    }, true);
+}
+
+void JIT::c_fld(Context& context)
+{
+    emit_floating(context, true, false, [](Context& context)
+    {
+        llvm::Value* value = perform_load(context, context.on_ld, [](Context& context)
+        {
+            const auto offset = context.current_compressed_instruction.get_ld_sd_imm();
+            return context.builder.CreateAdd(
+                rs1_c_alt,
+                u64_im(offset)
+            );
+        });
+        store_bits(context, context.current_compressed_instruction.get_rd_alt(), value);
+    }, true);
+}
+
+void JIT::c_fsd(Context& context)
+{
+    emit_floating(context, false, false, [](Context& context)
+    {
+        llvm::Value* value = load_bits(context, context.current_compressed_instruction.get_rs2_alt());
+        perform_store(context, context.on_sd, value, [](Context& context)
+        {
+            const auto offset = context.current_compressed_instruction.get_ld_sd_imm();
+            return context.builder.CreateAdd(
+                rs1_c_alt,
+                u64_im(offset)
+            );
+        });
+    }, true);
+}
+
+// -- Helpers --
+
+// Wherever the compiler has put mstatus.FS
+static const u64 fs_mask = []()
+{
+    MStatus::Fields fields = {};
+    fields.fs = 3;
+
+    u64 mask;
+    memcpy(&mask, &fields, sizeof(mask));
+    return mask;
+}();
+
+template<typename F>
+static void emit_floating(Context& context, bool is_write, bool is_rounded, F&& emit, bool is_compressed)
+{
+    llvm::IRBuilder<>& builder = context.builder;
+    llvm::Function* function = builder.GetInsertBlock()->getParent();
+
+    // A static rounding mode is known now, but a dynamic one could be anything
+    // by the time we get here
+    const u8 rounding_mode = is_rounded ?
+        context.current_instruction.get_rounding_mode() :
+        (u8)FCSR::RoundingMode::RNE;
+
+    if (rounding_mode != FCSR::RoundingMode::RNE && rounding_mode != FCSR::RoundingMode::DYNAMIC)
+    {
+        fall_back(context.on_floating, context);
+        return;
+    }
+
+    // Using the FPU while it's turned off is an illegal instruction
+    llvm::Value* mstatus = builder.CreateLoad(builder.getInt64Ty(), context.mstatus);
+    llvm::Value* is_native = builder.CreateICmpNE(builder.CreateAnd(mstatus, u64_im(fs_mask)), u64_im(0));
+    if (rounding_mode == FCSR::RoundingMode::DYNAMIC)
+    {
+        llvm::Value* fcsr = builder.CreateLoad(builder.getInt32Ty(), context.fcsr);
+        llvm::Value* is_nearest = builder.CreateICmpEQ(
+            builder.CreateAnd(fcsr, u32_im(0b111 << 5)),
+            u32_im(FCSR::RoundingMode::RNE << 5)
+        );
+        is_native = builder.CreateAnd(is_native, is_nearest);
+    }
+
+    llvm::Function* fallback = is_compressed ? context.on_floating_compressed : context.on_floating;
+    emit_or_fall_back(context, is_native, fallback, [&](Context& context)
+    {
+        // The FPU's state becomes dirty as soon as it's written to, as in
+        // check_fs_field
+        if (is_write)
+            builder.CreateStore(builder.CreateOr(mstatus, u64_im(fs_mask)), context.mstatus);
+
+        llvm::IRBuilderBase::FastMathFlagGuard guard(builder);
+        builder.setIsFPConstrained(true);
+        builder.setDefaultConstrainedExcept(llvm::fp::ebStrict);
+        builder.setDefaultConstrainedRounding(llvm::RoundingMode::NearestTiesToEven);
+        function->addFnAttr(llvm::Attribute::StrictFP);
+        emit(context);
+    }, is_compressed);
+}
+
+static llvm::Value* load_float(Context& context, u32 index)
+{
+    // Anything that isn't NaN-boxed reads as the canonical NaN
+    llvm::Value* bits = load_bits(context, index);
+    llvm::Value* is_boxed = context.builder.CreateICmpEQ(
+        context.builder.CreateAnd(bits, u64_im(0xffffffff00000000)),
+        u64_im(0xffffffff00000000)
+    );
+    llvm::Value* value = context.builder.CreateSelect(is_boxed, u64_to_32(bits), u32_im(qNaN_float));
+    return context.builder.CreateBitCast(value, context.builder.getFloatTy());
+}
+
+static llvm::Value* load_double(Context& context, u32 index)
+{
+    return context.builder.CreateBitCast(load_bits(context, index), context.builder.getDoubleTy());
+}
+
+static llvm::Value* load_bits(Context& context, u32 index)
+{
+    llvm::Value* address = context.builder.CreateConstInBoundsGEP1_64(
+        context.builder.getInt64Ty(),
+        context.float_registers,
+        index
+    );
+    return context.builder.CreateLoad(context.builder.getInt64Ty(), address);
+}
+
+static void store_float(Context& context, u32 index, llvm::Value* value)
+{
+    // NaNs are canonicalised, as in compute (see opcodes_f.cpp)
+    llvm::Value* bits = context.builder.CreateBitCast(value, context.builder.getInt32Ty());
+    llvm::Value* is_nan = context.builder.CreateICmpUGT(
+        context.builder.CreateAnd(bits, u32_im(0x7fffffff)),
+        u32_im(0x7f800000)
+    );
+    bits = context.builder.CreateSelect(is_nan, u32_im(qNaN_float), bits);
+    store_bits(context, index, box(context, bits));
+}
+
+static void store_double(Context& context, u32 index, llvm::Value* value)
+{
+    llvm::Value* bits = context.builder.CreateBitCast(value, context.builder.getInt64Ty());
+    llvm::Value* is_nan = context.builder.CreateICmpUGT(
+        context.builder.CreateAnd(bits, u64_im(0x7fffffffffffffff)),
+        u64_im(0x7ff0000000000000)
+    );
+    store_bits(context, index, context.builder.CreateSelect(is_nan, u64_im(qNaN_double), bits));
+}
+
+static void store_bits(Context& context, u32 index, llvm::Value* value)
+{
+    llvm::Value* address = context.builder.CreateConstInBoundsGEP1_64(
+        context.builder.getInt64Ty(),
+        context.float_registers,
+        index
+    );
+    context.builder.CreateStore(value, address);
+}
+
+static llvm::Value* box(Context& context, llvm::Value* value)
+{
+    return context.builder.CreateOr(zero_extend(context, value), u64_im(0xffffffff00000000));
+}
+
+static llvm::Value* call_intrinsic(Context& context, llvm::Intrinsic::ID id, llvm::Value* value)
+{
+    llvm::Module* module = context.builder.GetInsertBlock()->getModule();
+    llvm::Function* intrinsic = llvm::Intrinsic::getDeclaration(module, id, { value->getType() });
+    return context.builder.CreateConstrainedFPCall(intrinsic, { value });
+}
+
+static llvm::Value* get_load_address(Context& context)
+{
+    return context.builder.CreateAdd(
+        u64_im(context.current_instruction.get_imm(Instruction::Type::I)),
+        rs1
+    );
+}
+
+static llvm::Value* get_store_address(Context& context)
+{
+    return context.builder.CreateAdd(
+        u64_im(context.current_instruction.get_imm(Instruction::Type::S)),
+        rs1
+    );
+}
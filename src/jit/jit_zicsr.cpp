@@ -4,9 +4,82 @@
 
 using namespace JIT;
 
-void JIT::csrrw (Context& context) { fall_back(context.on_csr, context); }
-void JIT::csrrc (Context& context) { fall_back(context.on_csr, context); }
-void JIT::csrrs (Context& context) { fall_back(context.on_csr, context); }
-void JIT::csrrwi(Context& context) { fall_back(context.on_csr, context); }
-void JIT::csrrsi(Context& context) { fall_back(context.on_csr, context); }
-void JIT::csrrci(Context& context) { fall_back(context.on_csr, context); }
+/*
+    Trap handlers spend most of their time on the scratch, EPC, cause and
+    tval CSRs, which have no side effects, so those are done in place once
+    the privilege level's been checked. Anything else could change how
+    memory is translated, etc. so is left to the interpreter.
+*/
+enum class CSROperation
+{
+    Write,
+    Set,
+    Clear
+};
+
+static void emit_csr(Context& context, CSROperation operation, bool is_immediate);
+
+void JIT::csrrw (Context& context) { emit_csr(context, CSROperation::Write, false); }
+void JIT::csrrc (Context& context) { emit_csr(context, CSROperation::Clear, false); }
+void JIT::csrrs (Context& context) { emit_csr(context, CSROperation::Set,   false); }
+void JIT::csrrwi(Context& context) { emit_csr(context, CSROperation::Write, true);  }
+void JIT::csrrsi(Context& context) { emit_csr(context, CSROperation::Set,   true);  }
+void JIT::csrrci(Context& context) { emit_csr(context, CSROperation::Clear, true);  }
+
+// -- Helpers --
+
+static void emit_csr(Context& context, CSROperation operation, bool is_immediate)
+{
+    const u16 address = context.current_instruction.get_imm(Instruction::Type::I) & 0xfff;
+    const auto csr = context.csrs.find(address);
+    if (csr == context.csrs.end())
+    {
+        fall_back(context.on_csr, context);
+        return;
+    }
+
+    // Not privileged enough - raise the exception
+    llvm::Value* privilege_level = context.builder.CreateLoad(context.builder.getInt32Ty(), context.privilege_level);
+    llvm::Value* is_allowed = context.builder.CreateICmpUGE(
+        privilege_level,
+        u32_im((u32)CSR::get_privilege_level(address))
+    );
+
+    emit_or_fall_back(context, is_allowed, context.on_csr, [&](Context& context)
+    {
+        // Set and clear don't write at all when rs1 is x0 (or the immediate
+        // is 0), though nothing happens on a read or write here anyway
+        const u32 source = context.current_instruction.get_rs1();
+        llvm::Value* operand = is_immediate ? u64_im(source) : rs1;
+        llvm::Value* value = context.builder.CreateLoad(context.builder.getInt64Ty(), csr->second);
+        llvm::Value* new_value = nullptr;
+
+        switch (operation)
+        {
+            case CSROperation::Write:
+                new_value = operand;
+                break;
+
+            case CSROperation::Set:
+                if (source != 0)
+                    new_value = context.builder.CreateOr(value, operand);
+                break;
+
+            case CSROperation::Clear:
+                if (source != 0)
+                    new_value = context.builder.CreateAnd(value, context.builder.CreateNot(operand));
+                break;
+        }
+
+        if (new_value != nullptr)
+        {
+            // WARL; see MEPC::write
+            if (address == CSR_SEPC || address == CSR_MEPC)
+                new_value = context.builder.CreateAnd(new_value, u64_im(0xfffffffffffffffe));
+
+            context.builder.CreateStore(new_value, csr->second);
+        }
+
+        set_rd(value);
+    });
+}
@@ -4,18 +4,24 @@
 
 static void print_usage(char** argv)
 {
-    std::cerr << "usage: " << argv[0] << " [--test] [--jit] [--image FILE] [--blk FILE] [--initramfs FILE]" << std::endl;
+    std::cerr << "usage: " << argv[0] << " [--test] [--jit] [--jit-threshold N] [--jit-stats] [--jit-sync] [--jit-cache DIR] [--jit-cache-size MB] [--jit-perf-map] [--image FILE] [--blk FILE] [--initramfs FILE]" << std::endl;
 }
 
 int main(int argc, char** argv)
 {
     typedef std::pair<std::string, std::optional<std::string>> Arg;
-    std::array<Arg, 5> args = {{
-        { "--test",         "n" },
-        { "--image",        std::nullopt },
-        { "--blk",          std::nullopt },
-        { "--initramfs",    std::nullopt },
-        { "--jit",          std::nullopt }
+    std::array<Arg, 11> args = {{
+        { "--test",             "n" },
+        { "--image",            std::nullopt },
+        { "--blk",              std::nullopt },
+        { "--initramfs",        std::nullopt },
+        { "--jit",              std::nullopt },
+        { "--jit-threshold",    std::nullopt },
+        { "--jit-stats",        std::nullopt },
+        { "--jit-sync",         std::nullopt },
+        { "--jit-cache",        std::nullopt },
+        { "--jit-cache-size",   std::nullopt },
+        { "--jit-perf-map",     std::nullopt }
     }};
 
     // Parse argc
@@ -27,7 +33,8 @@ int main(int argc, char** argv)
         {
             if (std::string(argv[i]) == args[j].first)
             {
-                if (args[j].first == "--test" || args[j].first == "--jit")
+                if (args[j].first == "--test" || args[j].first == "--jit" || args[j].first == "--jit-stats" ||
+                    args[j].first == "--jit-sync" || args[j].first == "--jit-perf-map")
                     args[j].second = "y";
                 else
                 {
@@ -90,11 +97,23 @@ int main(int argc, char** argv)
         {
             while(1)
             {
+                // Tests are traced an instruction at a time; otherwise a
+                // block's run at once, and everything else is caught up
+                // on (and interrupts checked for) between blocks
                 if constexpr(test_mode)
+                {
                     cpu.trace();
-
-                cpu.do_cycle();
-                cpu.bus.clock(cpu);
+                    cpu.do_cycle();
+                    cpu.bus.clock(cpu);
+                }
+                else
+                {
+                    const u64 instructions = cpu.run_block();
+                    cpu.bus.clock(cpu, false, instructions);
+                    cpu.mcycle.increment(cpu, instructions);
+                    cpu.minstret.increment(cpu, instructions);
+                    cpu.time.increment(cpu, instructions);
+                }
 
                 const std::optional<CPU::PendingTrap> trap = cpu.get_pending_trap();
                 if (trap.has_value())
@@ -110,14 +129,26 @@ int main(int argc, char** argv)
     // JIT
     else
     {
-        JIT::init();
+        JIT::Options options;
+        if (args[5].second.has_value())
+            options.hot_threshold = std::stoull(*args[5].second);
+        options.print_statistics = args[6].second.has_value();
+        options.background_compilation = !args[7].second.has_value();
+        options.cache_directory = args[8].second;
+        if (args[9].second.has_value())
+            options.code_budget = std::stoull(*args[9].second) * 1024 * 1024;
+        options.write_perf_map = args[10].second.has_value();
+
+        JIT::init(cpu, options);
         while(true)
         {
-            JIT::run_next_frame(cpu);
-            cpu.bus.clock(cpu, true);
-            cpu.mcycle.increment(cpu);
-            cpu.minstret.increment(cpu);
-            cpu.time.increment(cpu);
+            // Frames run any number of instructions, which everything else
+            // has to be caught up on
+            const u64 instructions = JIT::run_next_frame(cpu);
+            cpu.bus.clock(cpu, true, instructions);
+            cpu.mcycle.increment(cpu, instructions);
+            cpu.minstret.increment(cpu, instructions);
+            cpu.time.increment(cpu, instructions);
         }
     }
 }
@@ -122,7 +122,7 @@ void lr_w(CPU& cpu, const Instruction instruction)
     ATTEMPT_LOAD_32();
 
     cpu.registers[instruction.get_rd()] = (i64)(i32)*value;
-    cpu.bus.reservations.insert(address);
+    cpu.bus.reservation = address;
 }
 
 void sc_w(CPU& cpu, const Instruction instruction)
@@ -130,12 +130,15 @@ void sc_w(CPU& cpu, const Instruction instruction)
     GET_ADDRESS();
     CHECK_STORE_ALIGNMENT_32(address);
 
-    if (cpu.bus.reservations.contains(address))
+    // The reservation's gone either way
+    const bool is_reserved = cpu.bus.reservation == address;
+    cpu.bus.reservation = Bus::no_reservation;
+
+    if (is_reserved)
     {
         // Attempt store if we had a valid reservation
         ATTEMPT_WRITE_32(cpu.registers[instruction.get_rs2()]);
         cpu.registers[instruction.get_rd()] = 0;
-        cpu.bus.reservations.erase(address);
     }
     else cpu.registers[instruction.get_rd()] = 1;
 }
@@ -243,7 +246,7 @@ void lr_d(CPU& cpu, const Instruction instruction)
     ATTEMPT_LOAD_64();
 
     cpu.registers[instruction.get_rd()] = *value;
-    cpu.bus.reservations.insert(address);
+    cpu.bus.reservation = address;
 }
 
 void sc_d(CPU& cpu, const Instruction instruction)
@@ -251,12 +254,15 @@ void sc_d(CPU& cpu, const Instruction instruction)
     GET_ADDRESS();
     CHECK_STORE_ALIGNMENT_64(address);
 
-    if (cpu.bus.reservations.contains(address))
+    // The reservation's gone either way
+    const bool is_reserved = cpu.bus.reservation == address;
+    cpu.bus.reservation = Bus::no_reservation;
+
+    if (is_reserved)
     {
         // Attempt store if we had a valid reservation
         ATTEMPT_WRITE_64(cpu.registers[instruction.get_rs2()]);
         cpu.registers[instruction.get_rd()] = 0;
-        cpu.bus.reservations.erase(address);
     }
     else cpu.registers[instruction.get_rd()] = 1;
 }
@@ -7,262 +7,6 @@ u64 get_load_address(const CPU& cpu, const Instruction instruction);
 u64 get_store_address(const CPU& cpu, const Instruction instruction);
 bool check_branch_alignment(CPU& cpu, const u64 target);
 
-bool opcodes_base(CPU& cpu, const Instruction instruction)
-{
-    const u8 opcode = instruction.get_opcode();
-    const u8 funct3 = instruction.get_funct3();
-    const u8 funct7 = instruction.get_funct7();
-
-    switch (opcode)
-    {
-        case OPCODES_BASE_R_TYPE:
-        {
-            if (funct7 == OPCODES_M_FUNCT_7)
-                return false;
-
-            switch (funct3)
-            {
-                case ADD:
-                {
-                    switch (funct7)
-                    {
-                        case 0:     add(cpu, instruction); break;
-                        case SUB:   sub(cpu, instruction); break;
-                        default:    return false;
-                    }
-                    break;
-                }
-                case XOR:   _xor (cpu, instruction); break;
-                case OR:    _or  (cpu, instruction); break;
-                case AND:   _and (cpu, instruction); break;
-                case SLL:   sll  (cpu, instruction); break;
-
-                case OPCODES_SHIFT_RIGHT:
-                {
-                    switch (funct7)
-                    {
-                        case SRL: srl(cpu, instruction); break;
-                        case SRA: sra(cpu, instruction); break;
-                        default:  return false;
-                    }
-                    break;
-                }
-
-                case SLT:   slt (cpu, instruction); break;
-                case SLTU:  sltu(cpu, instruction); break;
-                default: return false;
-            }
-            break;
-        }
-
-        case OPCODES_BASE_I_TYPE:
-        {
-            switch (funct3)
-            {
-                case ADDI:  addi(cpu, instruction); break;
-                case XORI:  xori(cpu, instruction); break;
-                case ORI:   ori (cpu, instruction); break;
-                case ANDI:  andi(cpu, instruction); break;
-                case SLLI:  slli(cpu, instruction); break;
-
-                case OPCODES_SHIFT_RIGHT:
-                {
-                    switch (funct7 & 0b11111110)
-                    {
-                        case SRAI:  srai(cpu, instruction); break;
-                        case 0:     srli(cpu, instruction); break;
-                        default:    return false;
-                    }
-                    break;
-                }
-
-                case SLTI:   slti (cpu, instruction); break;
-                case SLTIU:  sltiu(cpu, instruction); break;
-
-                default: return false;
-            }
-            break;
-        }
-
-        case OPCODES_BASE_LOAD_TYPE:
-        {
-            switch (funct3)
-            {
-                case LB:    lb (cpu, instruction); break;
-                case LH:    lh (cpu, instruction); break;
-                case LW:    lw (cpu, instruction); break;
-                case LBU:   lbu(cpu, instruction); break;
-                case LHU:   lhu(cpu, instruction); break;
-
-                // RV64I-specific
-                case LWU:   lwu(cpu, instruction); break;
-                case LD:    ld (cpu, instruction); break;
-                default:    return false;
-            }
-            break;
-        }
-
-        case OPCODES_BASE_S_TYPE:
-        {
-            switch (funct3)
-            {
-                case SB:    sb(cpu, instruction); break;
-                case SH:    sh(cpu, instruction); break;
-                case SW:    sw(cpu, instruction); break;
-                case SD:    sd(cpu, instruction); break; // RV64I
-                default:    return false;
-            }
-            break;
-        }
-
-        case OPCODES_BASE_B_TYPE:
-        {
-            switch (funct3)
-            {
-                case BEQ:   beq (cpu, instruction); break;
-                case BNE:   bne (cpu, instruction); break;
-                case BLT:   blt (cpu, instruction); break;
-                case BGE:   bge (cpu, instruction); break;
-                case BLTU:  bltu(cpu, instruction); break;
-                case BGEU:  bgeu(cpu, instruction); break;
-                default:    return false;
-            }
-            break;
-        }
-
-        case JAL:   jal  (cpu, instruction); break;
-        case JALR:  jalr (cpu, instruction); break;
-
-        case LUI:   lui  (cpu, instruction); break;
-        case AUIPC: auipc(cpu, instruction); break;
-
-        case OPCODES_BASE_SYSTEM:
-        {
-            // 0 = CSR instructions - except for ebreak
-            if (funct3 != 0) return false;
-
-            const u8 rs2 = instruction.get_rs2();
-
-            if (rs2 == ECALL && funct7 == 0)
-            {
-                ecall(cpu, instruction);
-                return true;
-            }
-
-            if (rs2 == EBREAK && funct7 == 0)
-            {
-                ebreak(cpu, instruction);
-                return true;
-            }
-
-            if (rs2 == URET && funct7 == 0)
-            {
-                uret(cpu, instruction);
-                return true;
-            }
-
-            if (rs2 == 2 && funct7 == SRET)
-            {
-                sret(cpu, instruction);
-                return true;
-            }
-
-            if (rs2 == 2 && funct7 == MRET)
-            {
-                mret(cpu, instruction);
-                return true;
-            }
-
-            if (rs2 == 5 && funct7 == WFI)
-            {
-                wfi(cpu, instruction);
-                return true;
-            }
-
-            if (funct7 == SFENCE_VMA)
-            {
-                sfence_vma(cpu, instruction);
-                return true;
-            }
-
-            if (funct7 == HFENCE_BVMA) throw std::runtime_error("hfence.bvma");
-            if (funct7 == HFENCE_GVMA) throw std::runtime_error("hfence.gvma");
-
-            return false;
-        }
-
-        case OPCODES_BASE_FENCE:
-        {
-            // No cores; no need!
-            break;
-        }
-
-        case OPCODES_BASE_I_TYPE_32:
-        {
-            switch (funct3)
-            {
-                case ADDIW: addiw(cpu, instruction); break;
-                case SLLIW: slliw(cpu, instruction); break;
-
-                case OPCODES_SHIFT_RIGHT:
-                {
-                    switch (funct7)
-                    {
-                        case SRLIW: srliw(cpu, instruction); break;
-                        case SRAIW: sraiw(cpu, instruction); break;
-                        default:    return false;
-                    }
-                    break;
-                }
-
-                default: return false;
-            }
-            break;
-        }
-
-        case OPCODES_BASE_R_TYPE_32:
-        {
-            if (funct7 == OPCODES_M_FUNCT_7)
-                return false;
-
-            switch (funct3)
-            {
-                case ADDW:
-                {
-                    switch (funct7)
-                    {
-                        case ADDW:  addw(cpu, instruction); break;
-                        case SUBW:  subw(cpu, instruction); break;
-                        default:    return false;
-                    }
-                    break;
-                }
-
-                case SLLW: sllw(cpu, instruction); break;
-
-                case OPCODES_SHIFT_RIGHT:
-                {
-                    switch (funct7)
-                    {
-                        case SRLW:  srlw(cpu, instruction); break;
-                        case SRAW:  sraw(cpu, instruction); break;
-                        default:    return false;
-                    }
-                    break;
-                }
-
-                default: return false;
-            }
-            break;
-        }
-
-        default:
-            return false;
-    }
-
-    return true;
-}
-
 void add(CPU& cpu, const Instruction instruction)
 {
     cpu.registers[instruction.get_rd()] =
@@ -652,7 +396,7 @@ void sret(CPU& cpu, const Instruction instruction)
     cpu.mstatus.fields.spie = 1;
     cpu.mstatus.fields.spp = 0;
 
-    cpu.check_for_invalid_tlb();
+    cpu.update_tlb_permissions();
 }
 
 void mret(CPU& cpu, const Instruction instruction)
@@ -681,7 +425,7 @@ void mret(CPU& cpu, const Instruction instruction)
     cpu.mstatus.fields.mpie = 1;
     cpu.mstatus.fields.mpp = 0;
 
-    cpu.check_for_invalid_tlb();
+    cpu.update_tlb_permissions();
 }
 
 void wfi(CPU& cpu, const Instruction instruction)
@@ -716,12 +460,33 @@ void sfence_vma(CPU& cpu, const Instruction instruction)
     // current execution.
 
     // Have to trap when TVM = 1.
-    if (cpu.mstatus.fields.tvm == 1)
+    if (cpu.mstatus.fields.tvm == 1 && cpu.privilege_level == PrivilegeLevel::Supervisor)
+    {
         cpu.raise_exception(Exception::IllegalInstruction);
+        return;
+    }
 
-    // TODO: support local page flushes too
+    // rs1 gives a virtual address and rs2 an ASID to flush, with x0 meaning
+    // all of them
     if (cpu.privilege_level >= PrivilegeLevel::Supervisor)
-        cpu.invalidate_tlb();
+    {
+        const u8 rs1 = instruction.get_rs1();
+        const u8 rs2 = instruction.get_rs2();
+        cpu.invalidate_tlb(
+            rs1 != 0 ? std::optional<u64>(cpu.registers[rs1]) : std::nullopt,
+            rs2 != 0 ? std::optional<u64>(cpu.registers[rs2] & 0xffff) : std::nullopt
+        );
+    }
+}
+
+void fence_i(CPU& cpu, const Instruction instruction)
+{
+    // Synchronises the instruction and data streams; stores made before the
+    // fence must be visible to instruction fetches made after it. There's
+    // no instruction cache to speak of, and translated code on any page
+    // that's been written to is dropped as soon as the JIT notices (see
+    // Bus::mark_code_page), so this only has to end the frame.
+    cpu.instruction_cache_was_flushed = true;
 }
 
 void lwu(CPU& cpu, const Instruction instruction)
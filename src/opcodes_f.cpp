@@ -43,7 +43,7 @@ bool check_fs_field(CPU& cpu, bool is_write)
     if (is_write)
     {
         cpu.mstatus.fields.fs = 3;
-        cpu.check_for_invalid_tlb();
+        cpu.update_tlb_permissions();
     }
 
     return true;
@@ -336,6 +336,21 @@ static inline void set_rounding_mode(const CPU& cpu, const Instruction instructi
     }
 }
 
+// Copies any exceptions raised on the host FPU into fcsr; JIT'd code lets
+// them pile up and only calls this once a frame has returned
+void update_fcsr_flags(CPU& cpu)
+{
+    const int exceptions = std::fetestexcept(FE_ALL_EXCEPT);
+    if (exceptions == 0) [[likely]]
+        return;
+
+    if (exceptions & FE_INVALID)   cpu.fcsr.set_nv(cpu);
+    if (exceptions & FE_DIVBYZERO) cpu.fcsr.set_dz(cpu);
+    if (exceptions & FE_OVERFLOW)  cpu.fcsr.set_of(cpu);
+    if (exceptions & FE_UNDERFLOW) cpu.fcsr.set_uf(cpu);
+    if (exceptions & FE_INEXACT)   cpu.fcsr.set_nx(cpu);
+}
+
 /*
     Monitors host FPU exception flags so as to update FCSR.
     Also canonicalises NaNs, so required for all computations
@@ -354,11 +369,11 @@ static inline void compute(F&& f, CPU& cpu, const Instruction instruction, const
     f();
 
     // Query exceptions and update CSR accordingly
-    if (std::fetestexcept(FE_INVALID))   cpu.fcsr.set_nv(cpu);
-    if (std::fetestexcept(FE_DIVBYZERO)) cpu.fcsr.set_dz(cpu);
-    if (std::fetestexcept(FE_OVERFLOW))  cpu.fcsr.set_of(cpu);
-    if (std::fetestexcept(FE_UNDERFLOW)) cpu.fcsr.set_uf(cpu);
-    if (std::fetestexcept(FE_INEXACT))   cpu.fcsr.set_nx(cpu);
+    update_fcsr_flags(cpu);
+
+    // JIT'd code assumes the default is left in place
+    if (std::fegetround() != FE_TONEAREST) [[unlikely]]
+        std::fesetround(FE_TONEAREST);
 
     // Canonicalise NaNs
     const size_t index = rs1_output ? instruction.get_rs1() : instruction.get_rd();
@@ -400,7 +415,7 @@ static void round_result(CPU& cpu, const Instruction instruction)
     // If the rounded result is not representable in the destination
     // format, it is clipped to the nearest value and the invalid flag
     // is set. NaN is always treated as positive.
-    if (result > std::numeric_limits<T>::max() || std::isnan(result))  [[unlikely]]
+    if (std::isnan(result) || result > std::numeric_limits<T>::max())  [[unlikely]]
     {
         result = std::numeric_limits<T>::max();
         cpu.fcsr.set_nv(cpu);
@@ -629,7 +644,6 @@ void fdiv_s(CPU& cpu, const Instruction instruction)
 
 void fdiv_d(CPU& cpu, const Instruction instruction)
 {
-    set_rounding_mode(cpu, instruction);
     compute<double>([&]()
     {
         const double a = cpu.double_registers[instruction.get_rs1()];
@@ -658,8 +672,6 @@ void fsqrt_d(CPU& cpu, const Instruction instruction)
 
 void fsgnj_s(CPU& cpu, const Instruction instruction)
 {
-    set_rounding_mode(cpu, instruction);
-
     // Copy all bits (except the sign bit) from rs1, and use the sign bit of rs2
     const float a = cpu.float_registers[instruction.get_rs1()];
     const float b = cpu.float_registers[instruction.get_rs2()];
@@ -668,8 +680,6 @@ void fsgnj_s(CPU& cpu, const Instruction instruction)
 
 void fsgnj_d(CPU& cpu, const Instruction instruction)
 {
-    set_rounding_mode(cpu, instruction);
-
     // Copy all bits (except the sign bit) from rs1, and use the sign bit of rs2
     const double a = cpu.double_registers[instruction.get_rs1()];
     const double b = cpu.double_registers[instruction.get_rs2()];
@@ -678,8 +688,6 @@ void fsgnj_d(CPU& cpu, const Instruction instruction)
 
 void fsgnjn_s(CPU& cpu, const Instruction instruction)
 {
-    set_rounding_mode(cpu, instruction);
-
     // As above but rs2's sign is inverted
     const float a = cpu.float_registers[instruction.get_rs1()];
     const float b = cpu.float_registers[instruction.get_rs2()];
@@ -688,8 +696,6 @@ void fsgnjn_s(CPU& cpu, const Instruction instruction)
 
 void fsgnjn_d(CPU& cpu, const Instruction instruction)
 {
-    set_rounding_mode(cpu, instruction);
-
     // As above but rs2's sign is inverted
     const double a = cpu.double_registers[instruction.get_rs1()];
     const double b = cpu.double_registers[instruction.get_rs2()];
@@ -698,8 +704,6 @@ void fsgnjn_d(CPU& cpu, const Instruction instruction)
 
 void fsgnjx_s(CPU& cpu, const Instruction instruction)
 {
-    set_rounding_mode(cpu, instruction);
-
     // The sign bit is the XOR of the two sign bits
     const u32 a = as_u32(cpu.float_registers[instruction.get_rs1()]);
     const u32 b = as_u32(cpu.float_registers[instruction.get_rs2()]);
@@ -712,8 +716,6 @@ void fsgnjx_s(CPU& cpu, const Instruction instruction)
 
 void fsgnjx_d(CPU& cpu, const Instruction instruction)
 {
-    set_rounding_mode(cpu, instruction);
-
     // The sign bit is the XOR of the two sign bits
     const u64 a = as_u64(cpu.double_registers[instruction.get_rs1()]);
     const u64 b = as_u64(cpu.double_registers[instruction.get_rs2()]);
@@ -860,7 +862,7 @@ void fcvt_s_l(CPU& cpu, const Instruction instruction)
 {
     compute<float>([&]() {
         cpu.float_registers[instruction.get_rd()] =
-            (float)(i32)cpu.registers[instruction.get_rs1()];
+            (float)(i64)cpu.registers[instruction.get_rs1()];
     }, cpu, instruction);
 }
 
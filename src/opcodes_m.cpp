@@ -5,50 +5,6 @@ template<typename T> bool overflow(T dividend, T divisor);
 template<typename T> std::pair<T, T> get_operands(CPU& cpu, const Instruction instruction);
 void divide_by_zero(CPU& cpu, const Instruction instruction);
 
-bool opcodes_m(CPU& cpu, const Instruction instruction)
-{
-    const u64 opcode = instruction.get_opcode();
-    const u64 funct3 = instruction.get_funct3();
-
-    switch (opcode)
-    {
-        case OPCODES_M:
-        {
-            switch (funct3)
-            {
-                case MUL:       mul   (cpu, instruction); break;
-                case MULH:      mulh  (cpu, instruction); break;
-                case MULHSU:    mulhsu(cpu, instruction); break;
-                case MULHU:     mulhu (cpu, instruction); break;
-                case DIV:       div   (cpu, instruction); break;
-                case DIVU:      divu  (cpu, instruction); break;
-                case REM:       rem   (cpu, instruction); break;
-                case REMU:      remu  (cpu, instruction); break;
-                default:        return false;
-            }
-            break;
-        }
-
-        case OPCODES_M_32:
-        {
-            switch (funct3)
-            {
-                case MULW:      mulw (cpu, instruction);  break;
-                case DIVW:      divw (cpu, instruction);  break;
-                case DIVUW:     divuw(cpu, instruction);  break;
-                case REMW:      remw (cpu, instruction);  break;
-                case REMUW:     remuw(cpu, instruction);  break;
-                default:        return false;
-            }
-            break;
-        }
-
-        default: return false;
-    }
-
-    return true;
-}
-
 void mul(CPU& cpu, const Instruction instruction)
 {
     cpu.registers[instruction.get_rd()] =